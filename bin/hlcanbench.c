@@ -0,0 +1,1067 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * hlcanbench.c - benchmarks for the hlcan line discipline
+ *
+ * The benchmarks run against pseudo terminals, so no adapter is needed.
+ * The hlcan module has to be loaded and the program needs CAP_NET_ADMIN.
+ * The codec benchmark (-c) runs the packet helpers of hlcan.h that the
+ * ldisc decodes and encodes with and needs neither.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/tty.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#include "../hlcan.h"
+
+#define MAX_CHANNELS 1024
+
+/* channel counts of the suite, up to -J */
+#define SUITE_MAX_CHANNELS 64
+
+/* frames per channel and second while the suite measures latency */
+#define SUITE_LATENCY_RATE 500
+
+struct channel {
+	int master;
+	int slave;
+	pthread_t thread;
+	double attach_us;
+	int err;
+	char ifname[IFNAMSIZ];
+};
+
+/* duplex benchmark state */
+struct duplex {
+	struct channel ch;
+	int rx_sock;
+	int tx_sock;
+	volatile int running;
+	unsigned long rx_sent;		/* frames written to the pty    */
+	unsigned long rx_frames;	/* frames read from the socket  */
+	unsigned long tx_sent;		/* frames written to the socket */
+	unsigned long tx_bytes;		/* bytes read from the pty      */
+};
+
+/* the stream decoder of hlcan.h, fed the way slcan_unesc() feeds it */
+struct decoder {
+	struct hlcan_rx rx;
+	struct can_frame *frames;	/* decoded frames go here */
+	int max;
+	int n;
+	unsigned long cfg_packets;
+	unsigned long discarded;	/* bytes thrown away */
+	unsigned long skipped;		/* bytes dropped after an error */
+	unsigned long overruns;
+};
+
+/*
+ * suite state: channels are wired up in pairs, the TX side of one feeds
+ * the RX side of the other, a single channel is wired to itself
+ */
+struct suite_channel {
+	struct channel ch;
+	int rx_sock;
+	int tx_sock;
+	int peer;
+	unsigned char fwd[4096];	/* bytes the peer did not take yet */
+	int fwd_len;
+	unsigned long sent;
+	unsigned long received;
+	unsigned long tx_bytes;
+};
+
+struct suite {
+	struct suite_channel *ch;
+	int n;
+	volatile int running;
+	volatile int latency;		/* paced, time stamped frames */
+	double *samples;		/* latency in us */
+	unsigned long n_samples;
+	unsigned long max_samples;
+};
+
+static struct channel channels[MAX_CHANNELS];
+static pthread_barrier_t start_barrier;
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr, "\nUsage: %s [options]\n\n", prg);
+	fprintf(stderr, "Options: -a <n>     (attach benchmark: attach hlcan to <n> ptys)\n");
+	fprintf(stderr, "         -s         (attach one after another instead of concurrently)\n");
+	fprintf(stderr, "         -d <secs>  (duplex benchmark: full RX and TX load on one channel)\n");
+	fprintf(stderr, "         -r         (duplex benchmark with RX load only)\n");
+	fprintf(stderr, "         -t         (duplex benchmark with TX load only)\n");
+	fprintf(stderr, "         -c <n>     (codec benchmark: check the decoder, then time <n> frames)\n");
+	fprintf(stderr, "         -J <n>     (suite: load and latency on 1 up to <n> channels as JSON)\n");
+	fprintf(stderr, "                    (-d sets the seconds per step, default 3)\n");
+	fprintf(stderr, "         -h         (show this help page)\n");
+	fprintf(stderr, "\nExamples:\n");
+	fprintf(stderr, "hlcanbench -a 40\n");
+	fprintf(stderr, "hlcanbench -d 10\n");
+	fprintf(stderr, "hlcanbench -c 1000000\n");
+	fprintf(stderr, "hlcanbench -J 64 -d 5 > bench.json\n");
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* create a pty pair, the slave side is where the ldisc gets attached */
+static int open_pty(struct channel *ch)
+{
+	char *name;
+
+	ch->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (ch->master < 0)
+		return -1;
+
+	if (grantpt(ch->master) < 0 || unlockpt(ch->master) < 0)
+		goto err_master;
+
+	name = ptsname(ch->master);
+	if (!name)
+		goto err_master;
+
+	ch->slave = open(name, O_RDWR | O_NOCTTY);
+	if (ch->slave < 0)
+		goto err_master;
+
+	return 0;
+
+err_master:
+	close(ch->master);
+	return -1;
+}
+
+static void close_pty(struct channel *ch)
+{
+	int ldisc = N_TTY;
+
+	ioctl(ch->slave, TIOCSETD, &ldisc);
+	close(ch->slave);
+	close(ch->master);
+}
+
+static int attach(struct channel *ch)
+{
+	int ldisc = N_HLCAN;
+	double start = now_us();
+
+	ch->err = 0;
+	if (ioctl(ch->slave, TIOCSETD, &ldisc) < 0)
+		ch->err = errno;
+
+	ch->attach_us = now_us() - start;
+	return ch->err ? -1 : 0;
+}
+
+static void *attach_thread(void *arg)
+{
+	struct channel *ch = arg;
+
+	pthread_barrier_wait(&start_barrier);
+	attach(ch);
+	return NULL;
+}
+
+static int bench_attach(int n, int serial)
+{
+	double start, total, min = 0, max = 0, sum = 0;
+	int i, failed = 0;
+
+	for (i = 0; i < n; i++) {
+		if (open_pty(&channels[i]) < 0) {
+			perror("pty");
+			while (i--)
+				close_pty(&channels[i]);
+			return -1;
+		}
+	}
+
+	if (serial) {
+		start = now_us();
+		for (i = 0; i < n; i++)
+			attach(&channels[i]);
+		total = now_us() - start;
+	} else {
+		pthread_barrier_init(&start_barrier, NULL, n + 1);
+		for (i = 0; i < n; i++)
+			pthread_create(&channels[i].thread, NULL,
+				       attach_thread, &channels[i]);
+
+		pthread_barrier_wait(&start_barrier);
+		start = now_us();
+		for (i = 0; i < n; i++)
+			pthread_join(channels[i].thread, NULL);
+		total = now_us() - start;
+		pthread_barrier_destroy(&start_barrier);
+	}
+
+	for (i = 0; i < n; i++) {
+		struct channel *ch = &channels[i];
+
+		if (ch->err) {
+			if (!failed++)
+				fprintf(stderr, "attach failed: %s\n",
+					strerror(ch->err));
+			continue;
+		}
+		if (!min || ch->attach_us < min)
+			min = ch->attach_us;
+		if (ch->attach_us > max)
+			max = ch->attach_us;
+		sum += ch->attach_us;
+	}
+
+	printf("attach %s: %d channels, %d failed\n",
+	       serial ? "serial" : "concurrent", n, failed);
+	printf("  total %.1f us, per channel min %.1f avg %.1f max %.1f us\n",
+	       total, min, n > failed ? sum / (n - failed) : 0.0, max);
+
+	for (i = 0; i < n; i++)
+		close_pty(&channels[i]);
+
+	return failed ? -1 : 0;
+}
+
+/* bring a channel up at 1 Mbit/s and open a raw CAN socket on it */
+static int channel_up(struct channel *ch)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int s;
+
+	if (open_pty(ch) < 0 || attach(ch) < 0) {
+		perror("attach");
+		return -1;
+	}
+
+	if (ioctl(ch->slave, IO_CTL_CONFIG,
+		  HLCAN_CFG_ARG(HLCAN_SPEED_1000000, HLCAN_MODE_NORMAL,
+				HLCAN_FRAME_STANDARD)) < 0 ||
+	    ioctl(ch->slave, SIOCGIFNAME, ch->ifname) < 0) {
+		perror("ioctl");
+		return -1;
+	}
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, ch->ifname, IFNAMSIZ);
+	if (ioctl(s, SIOCGIFFLAGS, &ifr) < 0)
+		goto err;
+	ifr.ifr_flags |= IFF_UP;
+	if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0)
+		goto err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(ch->ifname);
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+
+	return s;
+
+err:
+	perror(ch->ifname);
+	close(s);
+	return -1;
+}
+
+/* plays the adapter: pushes received frames into the pty */
+static void *duplex_rx_feed(void *arg)
+{
+	struct duplex *d = arg;
+	struct pollfd pfd = { .fd = d->ch.master, .events = POLLOUT };
+	unsigned char buf[64 * HLCAN_DATA_FRAME_MAX];
+	unsigned char data[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	int len = 0, frame_len, i;
+	ssize_t n, m;
+
+	for (i = 0; i < 64; i++)
+		len += hlcan_data_frame(buf + len, 0x123, 0, 0, 8, data);
+	frame_len = len / 64;
+
+	/* whole frames only, so nothing is cut when the pty is full */
+	while (d->running) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		n = write(d->ch.master, buf, len);
+		if (n < 0) {
+			if (errno != EAGAIN)
+				break;
+			continue;
+		}
+		while (d->running && n % frame_len) {
+			m = write(d->ch.master, buf + n, frame_len - n % frame_len);
+			if (m > 0)
+				n += m;
+			else
+				poll(&pfd, 1, 100);
+		}
+		d->rx_sent += n / frame_len;
+	}
+	return NULL;
+}
+
+static void *duplex_rx_read(void *arg)
+{
+	struct duplex *d = arg;
+	struct pollfd pfd = { .fd = d->rx_sock, .events = POLLIN };
+	struct can_frame cf;
+
+	while (d->running) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(d->rx_sock, &cf, sizeof(cf)) == sizeof(cf))
+			d->rx_frames++;
+	}
+	return NULL;
+}
+
+static void *duplex_tx_send(void *arg)
+{
+	struct duplex *d = arg;
+	struct pollfd pfd = { .fd = d->tx_sock, .events = POLLOUT };
+	struct can_frame cf;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_id = 0x321;
+	cf.can_dlc = 8;
+
+	while (d->running) {
+		if (write(d->tx_sock, &cf, sizeof(cf)) == sizeof(cf)) {
+			d->tx_sent++;
+			continue;
+		}
+		/* queue is full, wait for the ldisc to catch up */
+		if (errno != ENOBUFS && errno != EAGAIN)
+			break;
+		poll(&pfd, 1, 1);
+	}
+	return NULL;
+}
+
+/* plays the adapter: takes whatever the ldisc transmits */
+static void *duplex_tx_drain(void *arg)
+{
+	struct duplex *d = arg;
+	struct pollfd pfd = { .fd = d->ch.master, .events = POLLIN };
+	unsigned char buf[4096];
+	ssize_t n;
+
+	while (d->running) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		n = read(d->ch.master, buf, sizeof(buf));
+		if (n > 0)
+			d->tx_bytes += n;
+	}
+	return NULL;
+}
+
+static int bench_duplex(int secs, int rx, int tx)
+{
+	static struct duplex d;
+	pthread_t threads[4];
+	int n = 0, loopback = 0;
+	double start, elapsed;
+
+	d.rx_sock = channel_up(&d.ch);
+	if (d.rx_sock < 0)
+		return -1;
+
+	/* a second socket for sending, so the RX count only sees the pty */
+	d.tx_sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (d.tx_sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(d.tx_sock, SOL_CAN_RAW, CAN_RAW_LOOPBACK,
+		   &loopback, sizeof(loopback));
+
+	fcntl(d.ch.master, F_SETFL, O_NONBLOCK);
+
+	d.running = 1;
+	start = now_us();
+	pthread_create(&threads[n++], NULL, duplex_tx_drain, &d);
+	if (rx) {
+		pthread_create(&threads[n++], NULL, duplex_rx_read, &d);
+		pthread_create(&threads[n++], NULL, duplex_rx_feed, &d);
+	}
+	if (tx)
+		pthread_create(&threads[n++], NULL, duplex_tx_send, &d);
+
+	sleep(secs);
+	d.running = 0;
+	elapsed = (now_us() - start) / 1e6;
+
+	while (n--)
+		pthread_join(threads[n], NULL);
+	close_pty(&d.ch);
+	close(d.tx_sock);
+	close(d.rx_sock);
+
+	printf("duplex %s: %d s on %s\n",
+	       rx && tx ? "rx+tx" : rx ? "rx" : "tx", secs, d.ch.ifname);
+	if (rx)
+		printf("  rx %.0f frames/s delivered, %lu of %lu frames lost\n",
+		       d.rx_frames / elapsed,
+		       d.rx_sent > d.rx_frames ? d.rx_sent - d.rx_frames : 0,
+		       d.rx_sent);
+	if (tx)
+		printf("  tx %.0f frames/s sent, %.0f bytes/s on the tty\n",
+		       d.tx_sent / elapsed, d.tx_bytes / elapsed);
+
+	return 0;
+}
+
+static void decoder_reset(struct decoder *d, struct can_frame *frames,
+			  int max)
+{
+	memset(d, 0, sizeof(*d));
+	d->frames = frames;
+	d->max = max;
+	memset(frames, 0, max * sizeof(*frames));
+}
+
+static void decode(struct decoder *d, const unsigned char *p, int len)
+{
+	struct can_frame *cf;
+	__u32 id;
+	int ext, rtr, plen, i;
+
+	for (i = 0; i < len; i++) {
+		switch (hlcan_rx_byte(&d->rx, p[i], &plen)) {
+		case HLCAN_RX_PACKET:
+			if (d->rx.buf[1] == HLCAN_CFG_PACKAGE_TYPE) {
+				d->cfg_packets++;
+				break;
+			}
+			if (d->n >= d->max)
+				break;
+			cf = &d->frames[d->n++];
+			cf->can_dlc = hlcan_parse_data_frame(d->rx.buf, &id,
+							     &ext, &rtr,
+							     cf->data);
+			cf->can_id = id | (ext ? CAN_EFF_FLAG : 0) |
+				(rtr ? CAN_RTR_FLAG : 0);
+			break;
+		case HLCAN_RX_SKIPPED:
+			d->skipped++;
+			break;
+		case HLCAN_RX_OVERRUN:
+			d->overruns++;
+			/* fall through */
+		case HLCAN_RX_NO_HEADER:
+		case HLCAN_RX_BAD_TYPE:
+			d->discarded += plen;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int encode(unsigned char *buf, const struct can_frame *cf)
+{
+	int ext = !!(cf->can_id & CAN_EFF_FLAG);
+
+	return hlcan_data_frame(buf, cf->can_id & (ext ? CAN_EFF_MASK :
+						   CAN_SFF_MASK),
+				ext, !!(cf->can_id & CAN_RTR_FLAG),
+				cf->can_dlc, cf->data);
+}
+
+/* Every kind of frame: standard, extended and RTR with each DLC */
+static void make_frames(struct can_frame *cf, int n)
+{
+	unsigned int r = 1;
+	int i, j;
+
+	memset(cf, 0, n * sizeof(*cf));
+	for (i = 0; i < n; i++) {
+		r = r * 1103515245 + 12345;
+		switch (i % 3) {
+		case 0:
+			cf[i].can_id = r >> 21 & CAN_SFF_MASK;
+			break;
+		case 1:
+			cf[i].can_id = (r & CAN_EFF_MASK) | CAN_EFF_FLAG;
+			break;
+		case 2:
+			cf[i].can_id = (r >> 21 & CAN_SFF_MASK) | CAN_RTR_FLAG;
+			break;
+		}
+		cf[i].can_dlc = i / 3 % (CAN_MAX_DLEN + 1);
+		if (cf[i].can_id & CAN_RTR_FLAG)
+			continue;
+		for (j = 0; j < cf[i].can_dlc; j++)
+			cf[i].data[j] = r >> (j % 4 * 8);
+	}
+}
+
+static int check_frames(const char *what, const struct decoder *d,
+			const struct can_frame *want, int n,
+			unsigned long discarded)
+{
+	int i;
+
+	if (d->n != n || d->discarded != discarded) {
+		printf("  %s: %d frames, %lu bytes discarded, expected %d and %lu\n",
+		       what, d->n, d->discarded, n, discarded);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (memcmp(&d->frames[i], &want[i], sizeof(want[i]))) {
+			printf("  %s: frame %d is %08x#%d, expected %08x#%d\n",
+			       what, i, d->frames[i].can_id,
+			       d->frames[i].can_dlc, want[i].can_id,
+			       want[i].can_dlc);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * decode a stream cut in two at every offset, one with junk in it and
+ * one with a tty error, a resync and an overrun
+ */
+static int codec_check(void)
+{
+	static const unsigned char junk[][4] = {
+		{ 0x00, 0x55, 0xc8, 0x12 },	/* no packet start */
+		{ HLCAN_PACKET_START, 0x13, 0x01, 0x02 }, /* unknown type */
+		{ HLCAN_PACKET_START, 0xc9, 0x03, 0x04 }, /* DLC above 8 */
+	};
+	struct can_frame want[3 * (CAN_MAX_DLEN + 1)], got[64];
+	unsigned char stream[sizeof(want) / sizeof(want[0]) *
+			     HLCAN_DATA_FRAME_MAX + HLCAN_CFG_PACKAGE_LEN +
+			     sizeof(junk)];
+	struct decoder d;
+	int n = sizeof(want) / sizeof(want[0]);
+	int len = 0, i, k, errors = 0;
+
+	make_frames(want, n);
+	for (i = 0; i < n; i++) {
+		len += encode(stream + len, &want[i]);
+		/* a status reply in the middle must not disturb anything */
+		if (i == n / 2)
+			len += hlcan_status_packet(stream + len);
+	}
+
+	for (k = 0; k <= len; k++) {
+		decoder_reset(&d, got, 64);
+		decode(&d, stream, k);
+		decode(&d, stream + k, len - k);
+		if (check_frames("split", &d, want, n, 0) || d.cfg_packets != 1) {
+			printf("  stream split at byte %d of %d\n", k, len);
+			errors++;
+			break;
+		}
+	}
+	printf("  split: %d frames cut at %d offsets %s\n", n, len + 1,
+	       errors ? "FAILED" : "ok");
+
+	/* junk before every third frame, the decoder has to find its way back */
+	len = 0;
+	for (i = 0; i < n; i++) {
+		if (i % 3 == 0 && i / 3 < 3) {
+			memcpy(stream + len, junk[i / 3], sizeof(junk[0]));
+			len += sizeof(junk[0]);
+		}
+		len += encode(stream + len, &want[i]);
+	}
+	decoder_reset(&d, got, 64);
+	for (k = 0; k < len; k++)
+		decode(&d, stream + k, 1);
+	k = check_frames("junk", &d, want, n, sizeof(junk));
+	printf("  junk: %d frames after %zu bytes of junk %s\n", n,
+	       sizeof(junk), k ? "FAILED" : "ok");
+	errors += !!k;
+
+	/*
+	 * The tty flags a byte between two frames: the caller drops it and
+	 * the decoder the packet start after it, which would swallow the
+	 * next frame otherwise.
+	 */
+	decoder_reset(&d, got, 64);
+	for (i = 0; i < n; i++) {
+		decode(&d, stream, encode(stream, &want[i]));
+		if (i == n / 2) {
+			hlcan_rx_flag_error(&d.rx);
+			stream[0] = HLCAN_PACKET_START;
+			decode(&d, stream, 1);
+		}
+	}
+	k = check_frames("error", &d, want, n, 0) || d.skipped != 1;
+	printf("  error: %d frames around a flagged byte %s\n", n,
+	       k ? "FAILED" : "ok");
+	errors += !!k;
+
+	/*
+	 * Half a frame dropped by a resync, then a full buffer: the byte
+	 * that overruns it and the packet start after it are dropped.
+	 */
+	decoder_reset(&d, got, 64);
+	for (i = 0, k = 0; i < n; i++) {
+		len = encode(stream, &want[i]);
+		if (i == n / 3) {
+			decode(&d, stream, len / 2);
+			if (hlcan_rx_reset(&d.rx) != len / 2)
+				k = -1;
+		}
+		if (i == 2 * n / 3) {
+			d.rx.count = HLCAN_RX_BUF_LEN;
+			decode(&d, junk[0], 1);
+			decode(&d, junk[1], 1);
+		}
+		decode(&d, stream, len);
+	}
+	k = check_frames("resync", &d, want, n, HLCAN_RX_BUF_LEN) || k ||
+		d.overruns != 1 || d.skipped != 1;
+	printf("  resync: %d frames around a resync and an overrun %s\n", n,
+	       k ? "FAILED" : "ok");
+	errors += !!k;
+
+	return errors ? -1 : 0;
+}
+
+static int bench_codec(int count)
+{
+	struct can_frame *frames, *got;
+	struct decoder d = { 0 };
+	unsigned char *stream;
+	double start, enc_us, dec_us;
+	size_t len = 0, off;
+	int i, ret = 0;
+
+	printf("codec: decode check\n");
+	if (codec_check())
+		return -1;
+
+	frames = calloc(count, sizeof(*frames));
+	got = calloc(count, sizeof(*got));
+	stream = malloc((size_t)count * HLCAN_DATA_FRAME_MAX);
+	if (!frames || !got || !stream) {
+		perror("malloc");
+		ret = -1;
+		goto out;
+	}
+	make_frames(frames, count);
+
+	start = now_us();
+	for (i = 0; i < count; i++)
+		len += encode(stream + len, &frames[i]);
+	enc_us = now_us() - start;
+
+	/* chunks like a USB serial adapter hands them to the tty */
+	d.frames = got;
+	d.max = count;
+	start = now_us();
+	for (off = 0; off < len; off += 4096)
+		decode(&d, stream + off, len - off < 4096 ? len - off : 4096);
+	dec_us = now_us() - start;
+
+	if (d.n != count || memcmp(got, frames, count * sizeof(*got))) {
+		printf("codec: %d of %d frames decoded correctly\n", d.n, count);
+		ret = -1;
+		goto out;
+	}
+
+	printf("codec: %d frames, %zu bytes\n", count, len);
+	printf("  encode %.1f ns/frame\n", enc_us * 1e3 / count);
+	printf("  decode %.1f ns/frame, %.1f MB/s\n", dec_us * 1e3 / count,
+	       len / dec_us);
+out:
+	free(stream);
+	free(got);
+	free(frames);
+	return ret;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* busy time of all CPUs in ticks, from /proc/stat */
+static unsigned long long cpu_busy(void)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8)
+		memset(v, 0, sizeof(v));
+	fclose(f);
+
+	/* everything but idle and iowait */
+	return v[0] + v[1] + v[2] + v[5] + v[6] + v[7];
+}
+
+/* plays the wire between the channels of a pair */
+static void *suite_forward(void *arg)
+{
+	struct suite *st = arg;
+	struct pollfd pfd[SUITE_MAX_CHANNELS];
+	struct suite_channel *c, *p;
+	ssize_t n;
+	int i;
+
+	while (st->running) {
+		for (i = 0; i < st->n; i++) {
+			pfd[i].fd = st->ch[i].ch.master;
+			/* hold back until the peer took what is pending */
+			pfd[i].events = st->ch[i].fwd_len ? 0 : POLLIN;
+		}
+		if (poll(pfd, st->n, 1) < 0)
+			continue;
+
+		for (i = 0; i < st->n; i++) {
+			c = &st->ch[i];
+			p = &st->ch[c->peer];
+			if (!c->fwd_len && pfd[i].revents & POLLIN) {
+				n = read(c->ch.master, c->fwd, sizeof(c->fwd));
+				if (n > 0) {
+					c->fwd_len = n;
+					c->tx_bytes += n;
+				}
+			}
+			if (c->fwd_len) {
+				n = write(p->ch.master, c->fwd, c->fwd_len);
+				if (n > 0) {
+					memmove(c->fwd, c->fwd + n, c->fwd_len - n);
+					c->fwd_len -= n;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+static void *suite_send(void *arg)
+{
+	struct suite *st = arg;
+	unsigned long long ts, next = 0;
+	struct can_frame cf;
+	int i, busy, latency = 0;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_dlc = 8;
+
+	while (st->running) {
+		/* the periods start now, not when the thread did */
+		if (st->latency && !latency)
+			next = now_ns();
+		latency = st->latency;
+		if (latency) {
+			/* every channel sends once per period */
+			while (now_ns() < next)
+				usleep(50);
+			next += 1000000000ULL / SUITE_LATENCY_RATE;
+		}
+
+		busy = 0;
+		for (i = 0; i < st->n; i++) {
+			cf.can_id = (latency ? 0x200 : 0x100) + i;
+			ts = now_ns();
+			memcpy(cf.data, &ts, sizeof(ts));
+			if (write(st->ch[i].tx_sock, &cf, sizeof(cf)) == sizeof(cf))
+				st->ch[i].sent++;
+			else
+				busy++;
+		}
+		/* every queue is full, give the ldisc time to drain */
+		if (busy == st->n && !latency)
+			usleep(100);
+	}
+	return NULL;
+}
+
+static void *suite_receive(void *arg)
+{
+	struct suite *st = arg;
+	struct pollfd pfd[SUITE_MAX_CHANNELS];
+	unsigned long long ts;
+	struct can_frame cf;
+	int i;
+
+	for (i = 0; i < st->n; i++) {
+		pfd[i].fd = st->ch[i].rx_sock;
+		pfd[i].events = POLLIN;
+	}
+
+	while (st->running) {
+		if (poll(pfd, st->n, 100) <= 0)
+			continue;
+		for (i = 0; i < st->n; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			while (read(st->ch[i].rx_sock, &cf, sizeof(cf)) == sizeof(cf)) {
+				st->ch[i].received++;
+				if (!st->latency || (cf.can_id & 0x700) != 0x200 ||
+				    st->n_samples >= st->max_samples)
+					continue;
+				memcpy(&ts, cf.data, sizeof(ts));
+				st->samples[st->n_samples++] = (now_ns() - ts) / 1e3;
+			}
+		}
+	}
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, unsigned long n, double p)
+{
+	return n ? v[(unsigned long)(p * (n - 1))] : 0;
+}
+
+static void suite_reset(struct suite *st)
+{
+	int i;
+
+	for (i = 0; i < st->n; i++) {
+		st->ch[i].sent = 0;
+		st->ch[i].received = 0;
+		st->ch[i].tx_bytes = 0;
+	}
+	st->n_samples = 0;
+}
+
+/* one step of the suite on n channels, prints a JSON object */
+static int suite_run(int n, int secs, int first)
+{
+	static struct suite_channel ch[SUITE_MAX_CHANNELS];
+	struct suite st = { .ch = ch, .n = n };
+	unsigned long long cpu0, cpu1;
+	unsigned long rx = 0, tx_frames = 0, sent = 0;
+	double start, elapsed, ticks = sysconf(_SC_CLK_TCK);
+	pthread_t threads[3];
+	int i, up = 0, loopback = 0, flags, ret = -1;
+
+	memset(ch, 0, sizeof(ch));
+	for (i = 0; i < n; i++, up++) {
+		ch[i].peer = (i ^ 1) < n ? i ^ 1 : i;
+		ch[i].rx_sock = channel_up(&ch[i].ch);
+		if (ch[i].rx_sock < 0)
+			goto out;
+		ch[i].tx_sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (ch[i].tx_sock < 0) {
+			close(ch[i].rx_sock);
+			goto out;
+		}
+		/* the RX socket only sees what came over the wire */
+		setsockopt(ch[i].tx_sock, SOL_CAN_RAW, CAN_RAW_LOOPBACK,
+			   &loopback, sizeof(loopback));
+		fcntl(ch[i].tx_sock, F_SETFL, O_NONBLOCK);
+		fcntl(ch[i].rx_sock, F_SETFL, O_NONBLOCK);
+		flags = fcntl(ch[i].ch.master, F_GETFL);
+		fcntl(ch[i].ch.master, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	st.max_samples = (unsigned long)n * SUITE_LATENCY_RATE * (secs + 1);
+	st.samples = malloc(st.max_samples * sizeof(*st.samples));
+	if (!st.samples)
+		goto out;
+
+	st.running = 1;
+	pthread_create(&threads[0], NULL, suite_forward, &st);
+	pthread_create(&threads[1], NULL, suite_receive, &st);
+	pthread_create(&threads[2], NULL, suite_send, &st);
+
+	/* full load, settle first */
+	usleep(200000);
+	suite_reset(&st);
+	cpu0 = cpu_busy();
+	start = now_us();
+	sleep(secs);
+	elapsed = (now_us() - start) / 1e6;
+	cpu1 = cpu_busy();
+	for (i = 0; i < n; i++) {
+		rx += ch[i].received;
+		sent += ch[i].sent;
+		tx_frames += ch[i].tx_bytes;
+	}
+	/* 8 byte frames with standard ids */
+	tx_frames /= hlcan_data_frame_len(HLCAN_FRAME_PREFIX | 8);
+
+	/* paced frames for the latency, after the queues ran empty */
+	st.latency = 1;
+	usleep(500000);
+	suite_reset(&st);
+	sleep(secs);
+
+	st.running = 0;
+	for (i = 0; i < 3; i++)
+		pthread_join(threads[i], NULL);
+
+	qsort(st.samples, st.n_samples, sizeof(double), cmp_double);
+
+	printf("%s    {\n", first ? "" : ",\n");
+	printf("      \"channels\": %d,\n", n);
+	printf("      \"rx_fps_per_channel\": %.0f,\n", rx / elapsed / n);
+	printf("      \"tx_fps_per_channel\": %.0f,\n", tx_frames / elapsed / n);
+	printf("      \"rx_fps_total\": %.0f,\n", rx / elapsed);
+	printf("      \"tx_fps_total\": %.0f,\n", tx_frames / elapsed);
+	printf("      \"lost\": %lu,\n", tx_frames > rx ? tx_frames - rx : 0);
+	printf("      \"cpu_util\": %.3f,\n",
+	       (cpu1 - cpu0) / ticks / elapsed);
+	printf("      \"cpu_ns_per_frame\": %.0f,\n",
+	       rx ? (cpu1 - cpu0) / ticks * 1e9 / rx : 0.0);
+	printf("      \"latency_us\": { \"samples\": %lu, \"p50\": %.1f, "
+	       "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f }\n",
+	       st.n_samples, percentile(st.samples, st.n_samples, 0.5),
+	       percentile(st.samples, st.n_samples, 0.99),
+	       percentile(st.samples, st.n_samples, 0.999),
+	       percentile(st.samples, st.n_samples, 1));
+	printf("    }");
+	fflush(stdout);
+
+	fprintf(stderr, "%d channels: rx %.0f tx %.0f frames/s per channel, "
+		"latency p50 %.1f us p99 %.1f us\n", n, rx / elapsed / n,
+		tx_frames / elapsed / n,
+		percentile(st.samples, st.n_samples, 0.5),
+		percentile(st.samples, st.n_samples, 0.99));
+	ret = 0;
+	free(st.samples);
+out:
+	for (i = 0; i < up; i++) {
+		close(ch[i].tx_sock);
+		close(ch[i].rx_sock);
+		close_pty(&ch[i].ch);
+	}
+	return ret;
+}
+
+/* the whole suite as one JSON document on stdout */
+static int bench_suite(int max, int secs)
+{
+	int n, ret = 0;
+
+	printf("{\n  \"tool\": \"hlcanbench\",\n  \"secs\": %d,\n"
+	       "  \"runs\": [\n", secs);
+	/* powers of two, ending with max itself */
+	for (n = 1; !ret; n = n * 2 < max ? n * 2 : max) {
+		ret = suite_run(n, secs, n == 1);
+		if (n == max)
+			break;
+	}
+	printf("\n  ]\n}\n");
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int attach_count = 0;
+	int serial = 0;
+	int duplex_secs = 0;
+	int codec_frames = 0;
+	int suite_channels = 0;
+	int rx = 1, tx = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:sd:rtc:J:?h")) != -1) {
+		switch (opt) {
+		case 'a':
+			attach_count = atoi(optarg);
+			if (attach_count <= 0 || attach_count > MAX_CHANNELS)
+				print_usage(argv[0]);
+			break;
+		case 's':
+			serial = 1;
+			break;
+		case 'd':
+			duplex_secs = atoi(optarg);
+			if (duplex_secs <= 0)
+				print_usage(argv[0]);
+			break;
+		case 'r':
+			tx = 0;
+			break;
+		case 't':
+			rx = 0;
+			break;
+		case 'J':
+			suite_channels = atoi(optarg);
+			if (suite_channels <= 0 ||
+			    suite_channels > SUITE_MAX_CHANNELS)
+				print_usage(argv[0]);
+			break;
+		case 'c':
+			codec_frames = atoi(optarg);
+			if (codec_frames <= 0)
+				print_usage(argv[0]);
+			break;
+		case 'h':
+		case '?':
+		default:
+			print_usage(argv[0]);
+			break;
+		}
+	}
+
+	if (suite_channels)
+		return bench_suite(suite_channels, duplex_secs ? duplex_secs : 3) ?
+			EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (codec_frames)
+		return bench_codec(codec_frames) ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (duplex_secs) {
+		if (!rx && !tx)
+			print_usage(argv[0]);
+		return bench_duplex(duplex_secs, rx, tx) ?
+			EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!attach_count)
+		print_usage(argv[0]);
+
+	return bench_attach(attach_count, serial) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -43,6 +43,14 @@
 #include <linux/sockios.h>
 #include <linux/serial.h>
 #include <stdarg.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <linux/netlink.h>
 
 #include "../hlcan.h"
 
@@ -52,7 +60,7 @@
 /* Change this to the user under which to run */
 #define RUN_AS_USER "root"
 
-/* The length of ttypath buffer */
+/* The length of a tty path */
 #define TTYPATH_LENGTH	256
 
 /* UART flow control types */
@@ -62,15 +70,77 @@
 
 #define DEFAULT_UART_SPEED 2000000
 
+/* upper bound for the whole bitrate detection */
+#define AUTOBAUD_TIMEOUT_MS 5000
+/* valid frames without errors that end the detection early */
+#define AUTOBAUD_LOCK_FRAMES 8
+
+/* UART rates the speed probe tries, fastest first */
+static const long uart_probe_rates[] = {
+	3000000, 2000000, 1500000, 1228800, 1000000, 921600,
+	500000, 460800, 230400, 115200,
+};
+
+/* status requests and echoed frames that have to come back at a rate */
+#define UART_PROBE_ROUNDS 16
+#define UART_PROBE_TIMEOUT_MS 100
+
+/* 8N2: start bit, 8 data bits and two stop bits */
+#define UART_BITS_PER_BYTE 11
+
+/*
+ * Shortest time on the bus for the most bytes on the UART: standard id,
+ * 8 data bytes and no stuff bits take 111 bits with the interframe space
+ * and 13 bytes on the UART.
+ */
+#define CAN_FRAME_BITS 111
+#define CAN_FRAME_UART_BYTES 13
+
+/* adapters one hlcand handles */
+#define MAX_ADAPTERS 256
+
+/* USB ids of the QinHeng CH341 serial converter in the adapter */
+#define CH341_VENDOR "1a86"
+#define CH341_PRODUCT "7523"
+
+/* USB port paths such as 1-1.4.2, see /sys/bus/usb/devices */
+#define PORT_LENGTH 32
+
+struct adapter {
+	char tty[TTYPATH_LENGTH];
+	char name[IFNAMSIZ];		/* netdevice name asked for, if any */
+	char port[PORT_LENGTH];		/* USB port of a hotplugged adapter */
+	HLCAN_SPEED speed;
+	HLCAN_MODE mode;
+	HLCAN_FRAME_TYPE type;
+	long uart_speed;
+	int detect_speed;
+	int probe_uart;			/* find the fastest UART rate that works */
+
+	int fd;				/* -1 while the adapter is down */
+	char ifname[IFNAMSIZ];
+	long up_ms;			/* bring-up took that long */
+	pthread_t thread;
+	int started;
+	int pending;			/* to be brought up */
+	int watched;			/* in the event loop */
+};
+
+static struct adapter *adapters;
+static int n_adapters;
+
 static void fake_syslog(int priority, const char *format, ...)
 {
 	va_list ap;
 
+	/* adapters come up in threads of their own */
+	flockfile(stdout);
 	printf("[%d] ", priority);
 	va_start(ap, format);
 	vprintf(format, ap);
 	va_end(ap);
 	printf("\n");
+	funlockfile(stdout);
 }
 
 typedef void (*syslog_t)(int priority, const char *format, ...);
@@ -78,60 +148,33 @@ static syslog_t syslogger = syslog;
 
 void print_usage(char *prg)
 {
-	fprintf(stderr, "\nUsage: %s [options] <tty> [canif-name]\n\n", prg);
+	fprintf(stderr, "\nUsage: %s [options] <tty> [canif-name]\n", prg);
+	fprintf(stderr, "       %s [options] -c <config>\n\n", prg);
 	fprintf(stderr, "Options: -l         (set transciever to listen mode)\n");
-	fprintf(stderr, "         -s <speed> (set CAN speed in bits per second)\n");
+	fprintf(stderr, "         -s <speed> (set CAN speed in bits per second or 'auto' to detect it)\n");
 	fprintf(stderr, "         -S <speed> (set UART speed in baud)\n");
+	fprintf(stderr, "         -P         (probe for the fastest UART speed the adapter takes)\n");
 	fprintf(stderr, "         -e         (set interface to extended id mode)\n");
 	fprintf(stderr, "         -F         (stay in foreground; no daemonize)\n");
+	fprintf(stderr, "         -R         (reconfigure an attached tty in place and exit)\n");
 	fprintf(stderr, "         -m <mode>  (0: normal (default), 1: loopback, 2:silent, 3: loopback silent)\n");
+	fprintf(stderr, "         -c <file>  (adapters from <file>, one per line: <tty> [name=<canif>]\n");
+	fprintf(stderr, "                    [speed=<speed>|auto] [uart=<baud>] [mode=<mode>] [ext] [probe],\n");
+	fprintf(stderr, "                    options not given there are the ones above,\n");
+	fprintf(stderr, "                    usb:<port> instead of <tty> for an adapter on a USB port)\n");
+	fprintf(stderr, "         -u         (attach adapters plugged in, now and later)\n");
 	fprintf(stderr, "         -h         (show this help page)\n");
 	fprintf(stderr, "\nExamples:\n");
 	fprintf(stderr, "hlcand -m 2 -s 500000 /dev/ttyUSB0\n");
+	fprintf(stderr, "hlcand -R -s 250000 /dev/ttyUSB0\n");
+	fprintf(stderr, "hlcand -s auto /dev/ttyUSB0\n");
+	fprintf(stderr, "hlcand -s 500000 -c /etc/hlcan.conf\n");
+	fprintf(stderr, "hlcand -u -s 500000\n");
+	fprintf(stderr, "hlcand -P -s 1000000 /dev/ttyUSB0\n");
 	fprintf(stderr, "\n");
 	exit(EXIT_FAILURE);
 }
 
-static int slcand_running;
-static int exit_code;
-static char ttypath[TTYPATH_LENGTH];
-
-static void child_handler(int signum)
-{
-	switch (signum) {
-
-	case SIGUSR1:
-		/* exit parent */
-		exit(EXIT_SUCCESS);
-		break;
-	case SIGALRM:
-	case SIGCHLD:
-		syslogger(LOG_NOTICE, "received signal %i on %s", signum, ttypath);
-		exit_code = EXIT_FAILURE;
-		slcand_running = 0;
-		break;
-	case SIGINT:
-	case SIGTERM:
-		syslogger(LOG_NOTICE, "received signal %i on %s", signum, ttypath);
-		exit_code = EXIT_SUCCESS;
-		slcand_running = 0;
-		break;
-	}
-}
-
-static unsigned char hlcan_create_crc(unsigned char* data)
-{
-	unsigned char i, checksum = 0;
-
-	for (i = HLCAN_CFG_CRC_IDX;
-			i < HLCAN_CFG_PACKAGE_LEN - HLCAN_CFG_CRC_IDX - 1;
-			++i) {
-		checksum += *(data + i);
-	}
-
-	return checksum & 0xff;
-}
-
 static int command_settings(HLCAN_SPEED speed,
 			    HLCAN_MODE mode,
 			    HLCAN_FRAME_TYPE frame,
@@ -140,29 +183,9 @@ static int command_settings(HLCAN_SPEED speed,
 	int cmd_frame_len;
 	unsigned char cmd_frame[HLCAN_CFG_PACKAGE_LEN];
 
-	cmd_frame_len = 0;
-	cmd_frame[cmd_frame_len++] = HLCAN_PACKET_START;
-	cmd_frame[cmd_frame_len++] = HLCAN_CFG_PACKAGE_TYPE;
-	cmd_frame[cmd_frame_len++] = 0x12;
-	cmd_frame[cmd_frame_len++] = speed;
-	cmd_frame[cmd_frame_len++] = frame;
-	cmd_frame[cmd_frame_len++] = 0; /* Filter ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Filter ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Filter ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Filter ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Mask ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Mask ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Mask ID not handled. */
-	cmd_frame[cmd_frame_len++] = 0; /* Mask ID not handled. */
-	cmd_frame[cmd_frame_len++] = mode;
-	cmd_frame[cmd_frame_len++] = 0x01; // ?
-	cmd_frame[cmd_frame_len++] = 0;
-	cmd_frame[cmd_frame_len++] = 0;
-	cmd_frame[cmd_frame_len++] = 0;
-	cmd_frame[cmd_frame_len++] = 0;
-	cmd_frame[cmd_frame_len++] = hlcan_create_crc(cmd_frame);
-
-	if (write(fd, cmd_frame, HLCAN_CFG_PACKAGE_LEN) < 0) {
+	cmd_frame_len = hlcan_cfg_packet(cmd_frame, speed, mode, frame);
+
+	if (write(fd, cmd_frame, cmd_frame_len) < 0) {
 		syslogger(LOG_ERR, "write() failed: %s", strerror(errno));
 		return -1;
 	}
@@ -202,57 +225,1071 @@ static HLCAN_SPEED HLCAN_int_to_speed(const int speed)
 	}
 }
 
-int main(int argc, char *argv[])
+/*
+ * Speeds to try when detecting the bitrate, most common ones first.
+ * Slow buses see fewer frames per second, so they are listened to
+ * for longer.
+ */
+static const struct {
+	int bitrate;
+	HLCAN_SPEED speed;
+	int dwell_ms;
+} autobaud_probes[] = {
+	{ 500000, HLCAN_SPEED_500000, 150 },
+	{ 250000, HLCAN_SPEED_250000, 150 },
+	{ 125000, HLCAN_SPEED_125000, 200 },
+	{ 1000000, HLCAN_SPEED_1000000, 150 },
+	{ 100000, HLCAN_SPEED_100000, 200 },
+	{ 50000, HLCAN_SPEED_50000, 300 },
+	{ 800000, HLCAN_SPEED_800000, 150 },
+	{ 200000, HLCAN_SPEED_200000, 200 },
+	{ 400000, HLCAN_SPEED_400000, 150 },
+	{ 20000, HLCAN_SPEED_20000, 500 },
+	{ 10000, HLCAN_SPEED_10000, 500 },
+	{ 5000, HLCAN_SPEED_5000, 500 },
+};
+
+struct autobaud_score {
+	int frames;	/* complete 0xaa ... 0x55 frames */
+	int garbage;	/* bytes skipped to get back in sync */
+};
+
+static long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* check the byte stream for well formed data frames */
+static void autobaud_parse(struct autobaud_score *score,
+			   unsigned char *buf, int *len)
+{
+	int pos = 0, flen;
+
+	while (pos < *len) {
+		if (buf[pos] != HLCAN_PACKET_START) {
+			score->garbage++;
+			pos++;
+			continue;
+		}
+		if (*len - pos < 2)
+			break;
+		if ((buf[pos + 1] & HLCAN_TYPE_MASK & ~(HLCAN_FLAG_RTR | HLCAN_FLAG_ID_EXT))
+		    != HLCAN_FRAME_PREFIX || (buf[pos + 1] & 0x0f) > 8) {
+			score->garbage++;
+			pos++;
+			continue;
+		}
+		flen = hlcan_data_frame_len(buf[pos + 1]);
+		if (*len - pos < flen)
+			break;
+		if (buf[pos + flen - 1] != HLCAN_PACKET_END) {
+			score->garbage++;
+			pos++;
+			continue;
+		}
+		score->frames++;
+		pos += flen;
+	}
+
+	/* keep an incomplete frame for the next read */
+	memmove(buf, buf + pos, *len - pos);
+	*len -= pos;
+}
+
+/* listen to the bus at one speed for up to dwell_ms */
+static int autobaud_listen(int fd, HLCAN_SPEED speed, HLCAN_FRAME_TYPE type,
+			   int dwell_ms, struct autobaud_score *score)
+{
+	unsigned char buf[256];
+	struct timespec start;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int len = 0, ret;
+	long left;
+
+	memset(score, 0, sizeof(*score));
+	if (command_settings(speed, HLCAN_MODE_SILENT, type, fd) < 0)
+		return -1;
+
+	/* whatever arrived before is from the previous speed */
+	ioctl(fd, TCFLSH, TCIFLUSH);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((left = dwell_ms - elapsed_ms(&start)) > 0) {
+		if (poll(&pfd, 1, left) <= 0)
+			continue;
+
+		ret = read(fd, buf + len, sizeof(buf) - len);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+		len += ret;
+		autobaud_parse(score, buf, &len);
+		if (len == sizeof(buf))
+			len = 0;
+
+		if (score->frames >= AUTOBAUD_LOCK_FRAMES && !score->garbage)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Detect the bus bitrate: cycle through the speeds in silent mode and
+ * pick the one with the most valid frames and the fewest errors.
+ */
+static HLCAN_SPEED autobaud(int fd, HLCAN_FRAME_TYPE type)
+{
+	struct autobaud_score score, best_score = { 0, 0 };
+	struct timespec start;
+	unsigned int i;
+	int best = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < sizeof(autobaud_probes) / sizeof(autobaud_probes[0]); i++) {
+		if (elapsed_ms(&start) >= AUTOBAUD_TIMEOUT_MS)
+			break;
+
+		if (autobaud_listen(fd, autobaud_probes[i].speed, type,
+				    autobaud_probes[i].dwell_ms, &score) < 0)
+			return HLCAN_SPEED_INVALID;
+
+		syslogger(LOG_DEBUG, "autobaud: %d bit/s %d frames %d garbage bytes",
+			  autobaud_probes[i].bitrate, score.frames, score.garbage);
+
+		/* errors weigh as much as a frame's worth of bytes */
+		if (score.frames &&
+		    score.frames * 13 - score.garbage > best_score.frames * 13 - best_score.garbage) {
+			best = i;
+			best_score = score;
+		}
+
+		if (score.frames >= AUTOBAUD_LOCK_FRAMES && !score.garbage)
+			break;
+	}
+
+	if (best < 0) {
+		syslogger(LOG_NOTICE, "autobaud: no traffic found after %ld ms",
+			  elapsed_ms(&start));
+		return HLCAN_SPEED_INVALID;
+	}
+
+	syslogger(LOG_NOTICE, "autobaud: locked on %d bit/s after %ld ms (%d frames)",
+		  autobaud_probes[best].bitrate, elapsed_ms(&start),
+		  best_score.frames);
+	return autobaud_probes[best].speed;
+}
+
+
+static int uart_set_speed(int fd, long baud)
 {
-	const char *devprefix = "/dev/";
-	char *uart_speed_str = NULL;
-	static struct ifreq ifr;
 	struct termios2 tios;
-	char *tty = NULL;
-	char *pch;
-	int fd, opt;
 
-	long int uart_speed = DEFAULT_UART_SPEED;
-	int run_as_daemon = 1;
+	if (ioctl(fd, TCGETS2, &tios) < 0)
+		return -1;
+
+	tios.c_cflag &= ~CBAUD;
+	tios.c_cflag |= BOTHER;
+	tios.c_ispeed = (speed_t) baud;
+	tios.c_ospeed = (speed_t) baud;
+
+	return ioctl(fd, TCSETS2, &tios);
+}
+
+/*
+ * Read the replies to a probe until want_status status packets and the
+ * echoes of the want_echoes frames in sent came back. Returns the
+ * replies that were wrong or missing.
+ */
+static int uart_probe_replies(struct adapter *a,
+			      unsigned char (*sent)[HLCAN_DATA_FRAME_MAX],
+			      int want_status, int want_echoes)
+{
+	unsigned char buf[1024];
+	struct pollfd pfd = { .fd = a->fd, .events = POLLIN };
+	struct timespec start;
+	int status = 0, echoes = 0, errors = 0;
+	int len = 0, pos, plen, ret;
+	long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((status < want_status || echoes < want_echoes) &&
+	       (left = UART_PROBE_TIMEOUT_MS - elapsed_ms(&start)) > 0) {
+		if (poll(&pfd, 1, left) <= 0)
+			continue;
+		ret = read(a->fd, buf + len, sizeof(buf) - len);
+		if (ret <= 0)
+			continue;
+		len += ret;
+
+		for (pos = 0; pos < len; ) {
+			switch (hlcan_rx_state(buf + pos, len - pos, &plen)) {
+			case COMPLETE:
+				break;
+			case RECEIVING:
+				goto keep;
+			default:
+				errors++;
+				pos++;
+				continue;
+			}
+
+			if (buf[pos + 1] == HLCAN_CFG_PACKAGE_TYPE) {
+				if (status < want_status &&
+				    buf[pos + 2] == HLCAN_CFG_TYPE_STATUS &&
+				    buf[pos + plen - 1] == hlcan_cfg_crc(buf + pos))
+					status++;
+				else
+					errors++;
+			} else if (echoes < want_echoes &&
+				   !memcmp(buf + pos, sent[echoes], plen)) {
+				echoes++;
+			} else {
+				errors++;
+			}
+			pos += plen;
+		}
+keep:
+		/* keep the start of a packet for the next read */
+		memmove(buf, buf + pos, len - pos);
+		len -= pos;
+		if (len == sizeof(buf))
+			len = 0;
+	}
+
+	return errors + want_status - status + want_echoes - echoes;
+}
+
+/*
+ * Check the current UART rate with frames for the adapter to loop back,
+ * which is all the vendor protocol offers. Returns the frames that came
+ * back wrong or not at all, and anything else that came in.
+ */
+static int uart_probe_rate(struct adapter *a)
+{
+	unsigned char sent[UART_PROBE_ROUNDS][HLCAN_DATA_FRAME_MAX];
+	unsigned char data[8];
+	int ext = a->type == HLCAN_FRAME_EXTENDED;
+	int i, j, ret;
+
+	/*
+	 * Loopback at the fastest bitrate, slow ones would take longer
+	 * than the timeout. Silent as well, nothing gets on the bus.
+	 */
+	ioctl(a->fd, TCFLSH, TCIOFLUSH);
+	if (command_settings(HLCAN_SPEED_1000000, HLCAN_MODE_LOOPBACK_SILENT,
+			     a->type, a->fd) < 0)
+		return UART_PROBE_ROUNDS;
+
+	for (i = 0; i < UART_PROBE_ROUNDS; i++) {
+		/* start and end codes in the payload too */
+		for (j = 0; j < 8; j++)
+			data[j] = j & 1 ? HLCAN_PACKET_START : HLCAN_PACKET_END + i * j;
+		ret = hlcan_data_frame(sent[i], 0x123 + i, ext, 0, 8, data);
+		if (write(a->fd, sent[i], ret) != ret)
+			return UART_PROBE_ROUNDS;
+	}
+	return uart_probe_replies(a, sent, 0, UART_PROBE_ROUNDS);
+}
+
+/*
+ * Whether the adapter answers status requests, as status_poll_ms of the
+ * module needs. Only for the log, the vendor protocol has none.
+ */
+static int uart_probe_status(struct adapter *a)
+{
+	unsigned char req[HLCAN_CFG_PACKAGE_LEN];
+	int i, ret;
+
+	for (i = 0; i < UART_PROBE_ROUNDS; i++) {
+		ret = hlcan_status_packet(req);
+		if (write(a->fd, req, ret) != ret)
+			return -1;
+	}
+	return uart_probe_replies(a, NULL, UART_PROBE_ROUNDS, 0) ? -1 : 0;
+}
+
+/* Find the fastest UART rate at which the adapter answers everything right */
+static void uart_probe(struct adapter *a)
+{
+	unsigned int i;
+	int bad;
+
+	for (i = 0; i < sizeof(uart_probe_rates) / sizeof(uart_probe_rates[0]); i++) {
+		if (uart_set_speed(a->fd, uart_probe_rates[i]) < 0) {
+			syslogger(LOG_DEBUG, "%s: %ld baud not supported",
+				  a->tty, uart_probe_rates[i]);
+			continue;
+		}
+		bad = uart_probe_rate(a);
+		syslogger(LOG_DEBUG, "%s: %ld baud: %d bad replies",
+			  a->tty, uart_probe_rates[i], bad);
+		if (!bad) {
+			a->uart_speed = uart_probe_rates[i];
+			syslogger(LOG_INFO, "%s: %s status requests", a->tty,
+				  uart_probe_status(a) ? "no answer to" :
+				  "answers");
+			return;
+		}
+	}
+
+	syslogger(LOG_WARNING, "%s: no UART speed works, staying at %ld baud",
+		  a->tty, a->uart_speed);
+	uart_set_speed(a->fd, a->uart_speed);
+}
+
+/* Report how much faster than the bus the UART is, once the bitrate is known */
+static void uart_headroom(struct adapter *a)
+{
+	double uart_fps, bus_fps;
+	unsigned int i;
+	int bitrate = 0;
+
+	for (i = 0; i < sizeof(autobaud_probes) / sizeof(autobaud_probes[0]); i++)
+		if (autobaud_probes[i].speed == a->speed)
+			bitrate = autobaud_probes[i].bitrate;
+	if (!bitrate)
+		return;
+
+	uart_fps = (double)a->uart_speed / UART_BITS_PER_BYTE / CAN_FRAME_UART_BYTES;
+	bus_fps = (double)bitrate / CAN_FRAME_BITS;
+	syslogger(uart_fps < bus_fps ? LOG_WARNING : LOG_NOTICE,
+		  "%s: UART at %ld baud carries %.0f frames/s, %.2f times "
+		  "the %d bit/s bus at full load", a->tty, a->uart_speed,
+		  uart_fps, uart_fps / bus_fps, bitrate);
+}
+
+/* Prepend /dev/ to a bare tty name, paths are taken as they are */
+static void tty_path(char *dst, const char *tty)
+{
+	if (!strchr(tty, '/'))
+		snprintf(dst, TTYPATH_LENGTH, "/dev/%s", tty);
+	else
+		snprintf(dst, TTYPATH_LENGTH, "%s", tty);
+}
+
+/* Give the netdevice of an adapter the name asked for */
+static int adapter_rename(struct adapter *a)
+{
+	struct ifreq ifr;
+	int s, ret;
+
+	s = socket(PF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		syslogger(LOG_ERR, "socket() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	memcpy(ifr.ifr_name, a->ifname, IFNAMSIZ);
+	memcpy(ifr.ifr_newname, a->name, IFNAMSIZ);
+	ret = ioctl(s, SIOCSIFNAME, &ifr);
+	if (ret < 0)
+		syslogger(LOG_ERR, "renaming %s to %s failed: %s", a->ifname,
+			  a->name, strerror(errno));
+	else
+		strcpy(a->ifname, a->name);
+	close(s);
+
+	return ret;
+}
+
+/*
+ * Set up the UART and the adapter and attach the ldisc. Runs in a thread
+ * of its own for every adapter, so slow ttys do not hold up the others.
+ */
+static int adapter_up(struct adapter *a)
+{
+	struct timespec start;
+	struct termios2 tios;
+	struct serial_struct snew;
 	int ldisc = N_HLCAN;
 
-	HLCAN_MODE mode = HLCAN_MODE_NORMAL;
-	HLCAN_SPEED speed = HLCAN_SPEED_500000;
-	HLCAN_FRAME_TYPE type = HLCAN_FRAME_STANDARD;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	syslogger(LOG_INFO, "starting on TTY device %s", a->tty);
 
-	ttypath[0] = '\0';
+	a->fd = open(a->tty, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	if (a->fd < 0) {
+		syslogger(LOG_NOTICE, "failed to open TTY device %s: %s",
+			  a->tty, strerror(errno));
+		return -1;
+	}
+
+	if (ioctl(a->fd, TCGETS2, &tios) < 0) {
+		syslogger(LOG_NOTICE, "%s: ioctl() failed: %s", a->tty, strerror(errno));
+		goto err;
+	}
+
+	tios.c_cflag &= ~CBAUD;
+	tios.c_cflag = BOTHER | CS8 | CSTOPB;
+	tios.c_iflag = IGNPAR;
+	tios.c_oflag = 0;
+	tios.c_lflag = 0;
+	tios.c_ispeed = (speed_t) a->uart_speed;
+	tios.c_ospeed = (speed_t) a->uart_speed;
+
+	// Because of a recent change in linux - https://patchwork.kernel.org/patch/9589541/
+	// we need to set low latency flag to get proper receive latency
+	if (!ioctl(a->fd, TIOCGSERIAL, &snew)) {
+		snew.flags |= ASYNC_LOW_LATENCY;
+		ioctl(a->fd, TIOCSSERIAL, &snew);
+	}
+
+	if (ioctl(a->fd, TCSETS2, &tios) < 0) {
+		syslogger(LOG_NOTICE, "%s: ioctl() failed: %s", a->tty, strerror(errno));
+		goto err;
+	}
+
+	if (a->probe_uart)
+		uart_probe(a);
+
+	if (a->detect_speed) {
+		a->speed = autobaud(a->fd, a->type);
+		if (a->speed == HLCAN_SPEED_INVALID)
+			goto err;
+	}
+
+	if (a->probe_uart)
+		uart_headroom(a);
+
+	if (command_settings(a->speed, a->mode, a->type, a->fd) < 0)
+		goto err;
+
+	/* set hlcan like discipline on given tty */
+	if (ioctl(a->fd, TIOCSETD, &ldisc) < 0) {
+		syslogger(LOG_ERR, "%s: ioctl TIOCSETD failed: %s", a->tty, strerror(errno));
+		goto err;
+	}
+
+	/* let the ldisc know what the adapter has been set up with */
+	if (ioctl(a->fd, IO_CTL_CONFIG, HLCAN_CFG_ARG(a->speed, a->mode, a->type)) < 0)
+		syslogger(LOG_NOTICE, "%s: ioctl IO_CTL_CONFIG failed: %s",
+			  a->tty, strerror(errno));
+
+	/* retrieve the name of the created CAN netdevice */
+	if (ioctl(a->fd, SIOCGIFNAME, a->ifname) < 0) {
+		syslogger(LOG_NOTICE, "%s: ioctl SIOCGIFNAME failed: %s",
+			  a->tty, strerror(errno));
+		goto err_ldisc;
+	}
+
+	if (a->name[0] && strcmp(a->name, a->ifname) && adapter_rename(a) < 0)
+		goto err_ldisc;
+
+	a->up_ms = elapsed_ms(&start);
+	syslogger(LOG_NOTICE, "attached TTY %s to netdevice %s in %ld ms",
+		  a->tty, a->ifname, a->up_ms);
+	return 0;
+
+err_ldisc:
+	ldisc = N_TTY;
+	ioctl(a->fd, TIOCSETD, &ldisc);
+err:
+	close(a->fd);
+	a->fd = -1;
+	return -1;
+}
+
+static void *adapter_thread(void *arg)
+{
+	adapter_up(arg);
+	return NULL;
+}
+
+/* Reset the line discipline, the netdevice goes away with it */
+static void adapter_down(struct adapter *a)
+{
+	int ldisc = N_TTY;
+
+	if (a->fd < 0)
+		return;
+
+	syslogger(LOG_INFO, "stopping on TTY device %s", a->tty);
+	if (ioctl(a->fd, TIOCSETD, &ldisc) < 0 && errno != EIO)
+		syslogger(LOG_ERR, "%s: ioctl TIOCSETD failed: %s", a->tty, strerror(errno));
+	close(a->fd);
+	a->fd = -1;
+	syslogger(LOG_NOTICE, "terminated on %s", a->tty);
+}
+
+/* the ldisc is already attached, it applies the settings
+ * without taking the interface down */
+static int adapter_reconfigure(struct adapter *a)
+{
+	struct timespec start;
+	int fd, ret;
+
+	fd = open(a->tty, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	if (fd < 0) {
+		syslogger(LOG_NOTICE, "failed to open TTY device %s: %s",
+			  a->tty, strerror(errno));
+		return -1;
+	}
 
-	while ((opt = getopt(argc, argv, "es:S:m:?hF")) != -1) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = ioctl(fd, IO_CTL_RECONFIG, HLCAN_CFG_ARG(a->speed, a->mode, a->type));
+	if (ret < 0)
+		syslogger(LOG_ERR, "%s: ioctl IO_CTL_RECONFIG failed: %s",
+			  a->tty, strerror(errno));
+	else
+		syslogger(LOG_NOTICE, "reconfigured %s in %ld ms", a->tty,
+			  elapsed_ms(&start));
+	close(fd);
+
+	return ret;
+}
+
+static struct adapter *adapter_add(const struct adapter *defaults, const char *tty)
+{
+	struct adapter *a;
+
+	if (n_adapters == MAX_ADAPTERS) {
+		syslogger(LOG_ERR, "more than %d adapters", MAX_ADAPTERS);
+		return NULL;
+	}
+
+	a = &adapters[n_adapters++];
+	*a = *defaults;
+	if (tty)
+		tty_path(a->tty, tty);
+	a->fd = -1;
+	a->pending = tty != NULL;
+
+	return a;
+}
+
+/* apply one key=value of a config file line */
+static int adapter_option(struct adapter *a, const char *key, const char *val)
+{
+	if (!strcmp(key, "ext") && !val) {
+		a->type = HLCAN_FRAME_EXTENDED;
+	} else if (!strcmp(key, "probe") && !val) {
+		a->probe_uart = 1;
+	} else if (!val) {
+		return -1;
+	} else if (!strcmp(key, "name")) {
+		if (strlen(val) >= IFNAMSIZ)
+			return -1;
+		strcpy(a->name, val);
+	} else if (!strcmp(key, "speed")) {
+		a->detect_speed = !strcmp(val, "auto");
+		if (!a->detect_speed) {
+			a->speed = HLCAN_int_to_speed(atoi(val));
+			if (a->speed == HLCAN_SPEED_INVALID)
+				return -1;
+		}
+	} else if (!strcmp(key, "uart")) {
+		a->uart_speed = strtol(val, NULL, 10);
+		if (a->uart_speed <= 0)
+			return -1;
+	} else if (!strcmp(key, "mode")) {
+		a->mode = atoi(val);
+		if (a->mode > HLCAN_MODE_LOOPBACK_SILENT || a->mode < 0)
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * One adapter per line: the tty followed by options, options not given
+ * are taken from the command line.
+ *
+ *   # tty           options
+ *   /dev/ttyUSB0    name=can0 speed=500000
+ *   ttyUSB1         name=can1 speed=auto ext
+ *   /dev/ttyUSB2    speed=250000 mode=2 uart=2000000
+ *   usb:1-1.4       name=can3 speed=125000
+ *
+ * usb: lines are adapters plugged into that USB port, brought up with -u.
+ */
+static int read_config(const char *path, const struct adapter *defaults)
+{
+	char line[512], *tok, *val, *save;
+	struct adapter *a;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		syslogger(LOG_ERR, "failed to open %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+
+		tok = strtok_r(line, " \t", &save);
+		if (!tok)
+			continue;
+		if (!strncmp(tok, "usb:", 4)) {
+			a = adapter_add(defaults, NULL);
+			if (a)
+				snprintf(a->port, PORT_LENGTH, "%s", tok + 4);
+		} else {
+			a = adapter_add(defaults, tok);
+		}
+		if (!a)
+			goto err;
+
+		while ((tok = strtok_r(NULL, " \t", &save))) {
+			val = strchr(tok, '=');
+			if (val)
+				*val++ = '\0';
+			if (adapter_option(a, tok, val) < 0) {
+				syslogger(LOG_ERR, "%s:%d: invalid option %s",
+					  path, lineno, tok);
+				goto err;
+			}
+		}
+	}
+	fclose(f);
+
+	if (!n_adapters) {
+		syslogger(LOG_ERR, "%s: no adapters", path);
+		return -1;
+	}
+	return 0;
+
+err:
+	fclose(f);
+	return -1;
+}
+
+/*
+ * Bring the pending adapters up at once and report how long it took,
+ * from start and from boot. Returns the number of adapters brought up.
+ */
+static int bring_up(const struct timespec *start, const char *what)
+{
+	struct timespec boot;
+	int i, n = 0, up = 0;
+
+	for (i = 0; i < n_adapters; i++) {
+		if (!adapters[i].pending)
+			continue;
+		adapters[i].started = !pthread_create(&adapters[i].thread, NULL,
+						      adapter_thread, &adapters[i]);
+		if (!adapters[i].started)
+			adapter_up(&adapters[i]);
+	}
+
+	for (i = 0; i < n_adapters; i++) {
+		if (!adapters[i].pending)
+			continue;
+		if (adapters[i].started)
+			pthread_join(adapters[i].thread, NULL);
+		adapters[i].pending = 0;
+		if (adapters[i].fd >= 0)
+			up++;
+		n++;
+	}
+
+	clock_gettime(CLOCK_BOOTTIME, &boot);
+	syslogger(up == n ? LOG_NOTICE : LOG_WARNING,
+		  "%d of %d adapters up in %ld ms %s, %ld ms after boot",
+		  up, n, elapsed_ms(start), what,
+		  boot.tv_sec * 1000 + boot.tv_nsec / 1000000);
+
+	return up;
+}
+
+/*
+ * Find the USB device above a tty in sysfs and tell if it is the
+ * converter of an adapter. Its directory name is the port path.
+ */
+static int usb_port_of(const char *syspath, char *port)
+{
+	char path[PATH_MAX], file[PATH_MAX + 16], id[8];
+	char *slash;
+	FILE *f;
+	int ret;
+
+	if (!realpath(syspath, path))
+		return -1;
+
+	while ((slash = strrchr(path, '/')) && slash != path) {
+		*slash = '\0';
+
+		snprintf(file, sizeof(file), "%s/idVendor", path);
+		f = fopen(file, "r");
+		if (!f)
+			continue;
+		ret = fscanf(f, "%7s", id);
+		fclose(f);
+		if (ret != 1 || strcmp(id, CH341_VENDOR))
+			return -1;
+
+		snprintf(file, sizeof(file), "%s/idProduct", path);
+		f = fopen(file, "r");
+		if (!f)
+			return -1;
+		ret = fscanf(f, "%7s", id);
+		fclose(f);
+		if (ret != 1 || strcmp(id, CH341_PRODUCT))
+			return -1;
+
+		snprintf(port, PORT_LENGTH, "%s", strrchr(path, '/') + 1);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* USB port of the adapter behind a tty path, symlinks are followed */
+static int tty_usb_port(const char *tty, char *port)
+{
+	char dev[PATH_MAX], syspath[PATH_MAX + 16];
+
+	if (!realpath(tty, dev))
+		return -1;
+	snprintf(syspath, sizeof(syspath), "/sys/class/tty/%s",
+		 strrchr(dev, '/') + 1);
+	return usb_port_of(syspath, port);
+}
+
+/*
+ * A tty showed up, if it is an adapter mark it to be brought up. The
+ * entry of its USB port keeps the settings and the name across replugs,
+ * ports without an entry get one with the defaults and can<port> as name.
+ * An entry that lists the tty itself becomes the entry of its port, so
+ * the adapter is not set up twice.
+ */
+static int hotplug_add(const char *devname, const char *syspath,
+		       const struct adapter *defaults)
+{
+	char port[PORT_LENGTH], other[PORT_LENGTH];
+	struct adapter *a = NULL;
+	int i;
+
+	if (usb_port_of(syspath, port) < 0)
+		return 0;
+
+	for (i = 0; i < n_adapters; i++) {
+		if (!strcmp(adapters[i].port, port)) {
+			a = &adapters[i];
+			break;
+		}
+	}
+	for (i = 0; !a && i < n_adapters; i++) {
+		if (!adapters[i].port[0] && adapters[i].tty[0] &&
+		    !tty_usb_port(adapters[i].tty, other) &&
+		    !strcmp(other, port)) {
+			a = &adapters[i];
+			snprintf(a->port, PORT_LENGTH, "%s", port);
+		}
+	}
+	if (!a) {
+		a = adapter_add(defaults, NULL);
+		if (!a)
+			return 0;
+		snprintf(a->port, PORT_LENGTH, "%s", port);
+		/* too long a name keeps the one the module gave */
+		if (strlen("can") + strlen(port) < IFNAMSIZ)
+			snprintf(a->name, IFNAMSIZ, "can%s", port);
+	}
+	/* up already, or listed and about to be */
+	if (a->fd >= 0 || a->pending)
+		return 0;
+
+	syslogger(LOG_INFO, "adapter %s plugged into USB port %s", devname, port);
+	tty_path(a->tty, devname);
+	a->pending = 1;
+	return 1;
+}
+
+/* adapters that were plugged in before hlcand started */
+static void coldplug(const struct adapter *defaults)
+{
+	char syspath[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir("/sys/class/tty");
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "ttyUSB", 6))
+			continue;
+		snprintf(syspath, sizeof(syspath), "/sys/class/tty/%s", de->d_name);
+		hotplug_add(de->d_name, syspath, defaults);
+	}
+	closedir(dir);
+}
+
+static int uevent_open(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1,		/* kernel events, not the ones of udev */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		syslogger(LOG_ERR, "uevent socket failed: %s", strerror(errno));
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syslogger(LOG_ERR, "uevent bind failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void adapter_drop(int efd, struct adapter *a)
+{
+	syslogger(LOG_WARNING, "TTY %s (%s) went away", a->tty, a->ifname);
+	epoll_ctl(efd, EPOLL_CTL_DEL, a->fd, NULL);
+	a->watched = 0;
+	adapter_down(a);
+}
+
+/*
+ * Read the pending uevents: ttys that were added are marked to be brought
+ * up, adapters of removed ones are dropped if their hangup did not do that
+ * already. Returns the number of adapters marked.
+ */
+static int uevent_read(int ufd, int efd, const struct adapter *defaults)
+{
+	char buf[8192], syspath[PATH_MAX], tty[TTYPATH_LENGTH];
+	const char *action, *devpath, *subsystem, *devname;
+	struct sockaddr_nl addr;
+	socklen_t addrlen;
+	ssize_t len;
+	char *p;
+	int i, added = 0;
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		len = recvfrom(ufd, buf, sizeof(buf) - 1, 0,
+			       (struct sockaddr *)&addr, &addrlen);
+		if (len <= 0)
+			break;
+		/* only the kernel sends uevents */
+		if (addr.nl_pid)
+			continue;
+		buf[len] = '\0';
+
+		action = devpath = subsystem = devname = NULL;
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strncmp(p, "ACTION=", 7))
+				action = p + 7;
+			else if (!strncmp(p, "DEVPATH=", 8))
+				devpath = p + 8;
+			else if (!strncmp(p, "SUBSYSTEM=", 10))
+				subsystem = p + 10;
+			else if (!strncmp(p, "DEVNAME=", 8))
+				devname = p + 8;
+		}
+		if (!action || !devpath || !devname || !subsystem ||
+		    strcmp(subsystem, "tty"))
+			continue;
+
+		if (!strcmp(action, "add")) {
+			snprintf(syspath, sizeof(syspath), "/sys%s", devpath);
+			added += hotplug_add(devname, syspath, defaults);
+		} else if (!strcmp(action, "remove")) {
+			tty_path(tty, devname);
+			for (i = 0; i < n_adapters; i++)
+				if (adapters[i].fd >= 0 && !strcmp(adapters[i].tty, tty))
+					adapter_drop(efd, &adapters[i]);
+		}
+	}
+
+	return added;
+}
+
+/* add the adapters that came up to the event loop */
+static void watch(int efd)
+{
+	struct epoll_event ev = { .events = EPOLLHUP };
+	int i;
+
+	for (i = 0; i < n_adapters; i++) {
+		if (adapters[i].fd < 0 || adapters[i].watched)
+			continue;
+		ev.data.ptr = &adapters[i];
+		if (epoll_ctl(efd, EPOLL_CTL_ADD, adapters[i].fd, &ev) < 0)
+			syslogger(LOG_WARNING, "%s: not supervised: %s",
+				  adapters[i].tty, strerror(errno));
+		adapters[i].watched = 1;
+	}
+}
+
+static int adapters_up(void)
+{
+	int i, up = 0;
+
+	for (i = 0; i < n_adapters; i++)
+		if (adapters[i].fd >= 0)
+			up++;
+	return up;
+}
+
+/*
+ * Wait for a signal to stop or for adapters to go away. Adapters tell
+ * that by a hangup on their tty. With hotplug, adapters plugged in are
+ * brought up as soon as their uevent is in and hlcand keeps running with
+ * none left. Returns the exit code.
+ */
+static int supervise(int ufd, const struct adapter *defaults)
+{
+	static struct adapter signal_tag, uevent_tag;
+	struct epoll_event ev, events[16];
+	struct signalfd_siginfo si;
+	struct timespec start;
+	struct adapter *a;
+	sigset_t mask;
+	int efd, sfd, i, n;
+	int exit_code = EXIT_FAILURE;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	if (sfd < 0 || efd < 0) {
+		syslogger(LOG_ERR, "failed to set up the event loop: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &signal_tag;
+	epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+	if (ufd >= 0) {
+		ev.data.ptr = &uevent_tag;
+		epoll_ctl(efd, EPOLL_CTL_ADD, ufd, &ev);
+	}
+
+	watch(efd);
+
+	while (ufd >= 0 || adapters_up()) {
+		n = epoll_wait(efd, events, 16, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			syslogger(LOG_ERR, "epoll_wait() failed: %s", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			a = events[i].data.ptr;
+			if (a == &signal_tag) {
+				if (read(sfd, &si, sizeof(si)) != sizeof(si))
+					continue;
+				syslogger(LOG_NOTICE, "received signal %u", si.ssi_signo);
+				exit_code = EXIT_SUCCESS;
+				goto out;
+			}
+			if (a == &uevent_tag) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				if (uevent_read(ufd, efd, defaults))
+					bring_up(&start, "after plugging in");
+				watch(efd);
+				/*
+				 * The other events may be hangups of ttys that
+				 * were replugged just now, they are still pending
+				 * for the next epoll_wait() if they are current.
+				 */
+				break;
+			}
+			if (a->fd >= 0 && events[i].events & (EPOLLHUP | EPOLLERR))
+				adapter_drop(efd, a);
+		}
+	}
+	syslogger(LOG_ERR, "no adapters left");
+
+out:
+	close(efd);
+	close(sfd);
+	return exit_code;
+}
+
+int main(int argc, char *argv[])
+{
+	struct adapter defaults = {
+		.uart_speed = DEFAULT_UART_SPEED,
+		.mode = HLCAN_MODE_NORMAL,
+		.speed = HLCAN_SPEED_500000,
+		.type = HLCAN_FRAME_STANDARD,
+		.fd = -1,
+	};
+	struct adapter *a;
+	struct timespec start;
+	char *config = NULL;
+	int opt, i, ret = 0;
+
+	int run_as_daemon = 1;
+	int reconfigure = 0;
+	int hotplug = 0;
+	int ufd = -1;
+	int exit_code;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while ((opt = getopt(argc, argv, "es:S:m:c:Pu?hFR")) != -1) {
 		switch (opt) {
 		case 'e':
-			type = HLCAN_FRAME_EXTENDED;
+			defaults.type = HLCAN_FRAME_EXTENDED;
 			break;
 		case 'm':
 			errno = 0;
-			mode = atoi(optarg);
+			defaults.mode = atoi(optarg);
 			if (errno ||
-				mode > HLCAN_MODE_LOOPBACK_SILENT || mode < 0)
+				defaults.mode > HLCAN_MODE_LOOPBACK_SILENT || defaults.mode < 0)
 				print_usage(argv[0]);
 			break;
 		case 's':
+			if (!strcmp(optarg, "auto")) {
+				defaults.detect_speed = 1;
+				break;
+			}
 			errno = 0;
-			speed = atoi(optarg);
+			defaults.speed = atoi(optarg);
 			if (errno)
 				print_usage(argv[0]);
-			speed = HLCAN_int_to_speed(speed);
-			if (speed == HLCAN_SPEED_INVALID)
+			defaults.speed = HLCAN_int_to_speed(defaults.speed);
+			if (defaults.speed == HLCAN_SPEED_INVALID)
 				print_usage(argv[0]);
 			break;
 		case 'S':
-			uart_speed_str = optarg;
 			errno = 0;
-			uart_speed = strtol(uart_speed_str, NULL, 10);
+			defaults.uart_speed = strtol(optarg, NULL, 10);
 			if (errno)
 				print_usage(argv[0]);
 			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'P':
+			defaults.probe_uart = 1;
+			break;
+		case 'u':
+			hotplug = 1;
+			break;
 		case 'F':
 			run_as_daemon = 0;
 			break;
+		case 'R':
+			reconfigure = 1;
+			run_as_daemon = 0;
+			break;
 		case 'h':
 		case '?':
 		default:
@@ -267,95 +1304,56 @@ int main(int argc, char *argv[])
 	/* Initialize the logging interface */
 	openlog(DAEMON_NAME, LOG_PID, LOG_LOCAL5);
 
-	/* Parse serial device name and optional can interface name */
-	tty = argv[optind];
-	if (NULL == tty)
-		print_usage(argv[0]);
-
-	/* Prepare the tty device name string */
-	pch = strstr(tty, devprefix);
-	if (pch != tty)
-		snprintf(ttypath, TTYPATH_LENGTH, "%s%s", devprefix, tty);
-	else
-		snprintf(ttypath, TTYPATH_LENGTH, "%s", tty);
-
-	syslogger(LOG_INFO, "starting on TTY device %s", ttypath);
-
-	fd = open(ttypath, O_RDWR | O_NONBLOCK | O_NOCTTY);
-	if (fd < 0) {
-		syslogger(LOG_NOTICE, "failed to open TTY device %s\n", ttypath);
-		perror(ttypath);
+	adapters = calloc(MAX_ADAPTERS, sizeof(*adapters));
+	if (!adapters)
 		exit(EXIT_FAILURE);
-	}
 
-	if (ioctl(fd, TCGETS2, &tios) < 0) {
-		syslogger(LOG_NOTICE, "ioctl() failed: %s\n", strerror(errno));
-		close(fd);
+	/* Adapters from the config file, serial device name and optional
+	 * can interface name from the command line */
+	if (config && read_config(config, &defaults) < 0)
 		exit(EXIT_FAILURE);
+	if (argv[optind]) {
+		a = adapter_add(&defaults, argv[optind]);
+		if (!a)
+			exit(EXIT_FAILURE);
+		if (argv[optind + 1])
+			snprintf(a->name, IFNAMSIZ, "%s", argv[optind + 1]);
 	}
+	if (!n_adapters && !hotplug)
+		print_usage(argv[0]);
 
-	tios.c_cflag &= ~CBAUD;
-	tios.c_cflag = BOTHER | CS8 | CSTOPB;
-	tios.c_iflag = IGNPAR;
-	tios.c_oflag = 0;
-	tios.c_lflag = 0;
-	tios.c_ispeed = (speed_t) uart_speed;
-	tios.c_ospeed = (speed_t) uart_speed;
-
-	// Because of a recent change in linux - https://patchwork.kernel.org/patch/9589541/
-	// we need to set low latency flag to get proper receive latency
-	struct serial_struct snew;
-	ioctl (fd, TIOCGSERIAL, &snew);
-	snew.flags |= ASYNC_LOW_LATENCY;
-	ioctl (fd, TIOCSSERIAL, &snew);
-
-	if (ioctl(fd, TCSETS2, &tios) < 0) {
-		syslogger(LOG_NOTICE, "ioctl() failed: %s\n", strerror(errno));
-		close(fd);
-		exit(EXIT_FAILURE);
+	if (reconfigure) {
+		for (i = 0; i < n_adapters; i++)
+			if (adapters[i].tty[0] && adapter_reconfigure(&adapters[i]) < 0)
+				ret = -1;
+		exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
 	}
 
-	if (command_settings(speed, mode, type, fd) < 0){
-		close(fd);
-        	exit(EXIT_FAILURE);
+	/* listen before looking, so no adapter is missed in between */
+	if (hotplug) {
+		ufd = uevent_open();
+		if (ufd < 0)
+			exit(EXIT_FAILURE);
+		coldplug(&defaults);
 	}
 
-	/* set hlcan like discipline on given tty */
-	if (ioctl(fd, TIOCSETD, &ldisc) < 0) {
-		perror("ioctl TIOCSETD");
+	if (!bring_up(&start, "after start") && !hotplug)
 		exit(EXIT_FAILURE);
-	}
-	
-	syslogger(LOG_NOTICE, "attached TTY %s to netdevice %s\n", ttypath, ifr.ifr_name);
-	
+
 	/* Daemonize */
 	if (run_as_daemon) {
 		if (daemon(0, 0)) {
 			syslogger(LOG_ERR, "failed to daemonize");
 			exit(EXIT_FAILURE);
 		}
-	} else {
-		/* Trap signals that we expect to receive */
-		signal(SIGINT, child_handler);
-		signal(SIGTERM, child_handler);
 	}
 
-	slcand_running = 1;
-
-	/* The Big Loop, wait 1 second */
-	while (slcand_running)
-		sleep(1);
+	exit_code = supervise(ufd, &defaults);
 
-	/* Reset line discipline */
-	syslogger(LOG_INFO, "stopping on TTY device %s", ttypath);
-	ldisc = N_TTY;
-	if (ioctl(fd, TIOCSETD, &ldisc) < 0) {
-		perror("ioctl TIOCSETD");
-		exit(EXIT_FAILURE);
-	}
+	for (i = 0; i < n_adapters; i++)
+		adapter_down(&adapters[i]);
 
 	/* Finish up */
-	syslogger(LOG_NOTICE, "terminated on %s", ttypath);
 	closelog();
 	return exit_code;
 }
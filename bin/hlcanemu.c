@@ -0,0 +1,693 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * hlcanemu.c - HL-340 USB-CAN adapter emulator on pseudo terminals
+ *
+ * Every emulated adapter is a pty that talks the adapter protocol, so
+ * hlcand and the hlcan ldisc can be run against it without hardware.
+ * The adapters share one virtual bus: frames sent by one of them reach
+ * the others after the time the frame takes on the bus at its bitrate.
+ * Faults are injected with commands on stdin, see print_commands().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+
+#include "../hlcan.h"
+
+#define MAX_ADAPTERS	64
+
+/* bytes the adapter holds for the host before it loses frames */
+#define ADAPTER_FIFO	4096
+
+/* frames on their way over the bus */
+#define BUS_QUEUE	1024
+
+struct adapter {
+	int master;
+	int slave;			/* kept open so the pty stays up */
+	char name[64];
+	char link[256];			/* symlink to name, if any */
+
+	/* settings the host sent, speed 0 until the first valid one */
+	HLCAN_SPEED speed;
+	HLCAN_MODE mode;
+	HLCAN_FRAME_TYPE frame_type;
+	unsigned char rec;
+	unsigned char tec;
+	unsigned char status_flags;
+
+	/* bytes from the host */
+	struct hlcan_rx in;
+
+	/* bytes for the host */
+	unsigned char out[ADAPTER_FIFO];
+	int out_len;
+
+	/* pending faults */
+	int corrupt;
+	int drop;
+	int overflow;
+
+	unsigned long tx_frames;	/* from the host to the bus */
+	unsigned long rx_frames;	/* from the bus to the host */
+	unsigned long cfg_packets;
+	unsigned long bad_packets;	/* bad checksum, unknown type */
+	unsigned long lost_frames;	/* FIFO full or dropped */
+	unsigned long corrupted;
+};
+
+struct bus_frame {
+	double at_us;			/* end of the frame on the bus */
+	int src;			/* adapter index, -1 = generator */
+	int len;
+	unsigned char buf[HLCAN_DATA_FRAME_MAX];
+};
+
+static struct adapter adapters[MAX_ADAPTERS];
+static int n_adapters = 1;
+
+static struct bus_frame bus[BUS_QUEUE];
+static unsigned int bus_head, bus_tail;
+static double bus_free_us;		/* when the bus is idle again */
+static int bus_bitrate = 500000;
+static HLCAN_SPEED bus_speed = HLCAN_SPEED_500000;
+static int echo;			/* loop TX frames back to the sender */
+static int no_status;			/* ignore status requests, as the vendor firmware */
+
+static double gen_rate;			/* generated frames/s, < 0: bus load */
+static double gen_next_us;
+static unsigned long gen_frames;
+
+static volatile int running = 1;
+
+static const struct {
+	int bitrate;
+	HLCAN_SPEED speed;
+} speeds[] = {
+	{ 1000000, HLCAN_SPEED_1000000 },
+	{ 800000, HLCAN_SPEED_800000 },
+	{ 500000, HLCAN_SPEED_500000 },
+	{ 400000, HLCAN_SPEED_400000 },
+	{ 250000, HLCAN_SPEED_250000 },
+	{ 200000, HLCAN_SPEED_200000 },
+	{ 125000, HLCAN_SPEED_125000 },
+	{ 100000, HLCAN_SPEED_100000 },
+	{ 50000, HLCAN_SPEED_50000 },
+	{ 20000, HLCAN_SPEED_20000 },
+	{ 10000, HLCAN_SPEED_10000 },
+	{ 5000, HLCAN_SPEED_5000 },
+};
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr, "\nUsage: %s [options]\n\n", prg);
+	fprintf(stderr, "Options: -n <n>     (emulate <n> adapters on one bus, default 1)\n");
+	fprintf(stderr, "         -s <speed> (bitrate of the bus, default 500000)\n");
+	fprintf(stderr, "         -e         (echo frames back to the adapter that sent them)\n");
+	fprintf(stderr, "         -g <rate>  (generate <rate> frames/s on the bus, 'max' for full load)\n");
+	fprintf(stderr, "         -L <path>  (symlink <path>0, <path>1, ... to the ptys)\n");
+	fprintf(stderr, "         -N         (do not answer status requests, like the vendor firmware)\n");
+	fprintf(stderr, "         -h         (show this help page)\n");
+	fprintf(stderr, "\nExamples:\n");
+	fprintf(stderr, "hlcanemu -L /tmp/hlcanemu -n 2\n");
+	fprintf(stderr, "hlcanemu -s 125000 -g max\n");
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+static void print_commands(void)
+{
+	printf("commands, [a] is an adapter index, all adapters without it:\n");
+	printf("  corrupt <n> [a]   flip a bit in the next <n> frames to the host\n");
+	printf("  drop <n> [a]      lose the next <n> frames to the host\n");
+	printf("  overflow <n> [a]  lose <n> bytes in the middle of the next frame\n");
+	printf("  errors <rec> <tec> [a]  error counters of the status reply\n");
+	printf("  busoff [a]        report bus off until the next settings packet\n");
+	printf("  gen <rate|max>    generated frames/s, 0 stops it\n");
+	printf("  stats             show the counters\n");
+	printf("  quit\n");
+	fflush(stdout);
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sig_handler(int signum)
+{
+	if (signum == SIGINT || signum == SIGTERM)
+		running = 0;
+}
+
+/* nominal frame length on the bus without stuff bits, interframe space included */
+static int frame_bits(const unsigned char *buf)
+{
+	int dlc = buf[1] & 0x0f;
+
+	if (buf[1] & HLCAN_FLAG_RTR)
+		dlc = 0;
+	return ((buf[1] & HLCAN_FLAG_ID_EXT) ? 67 : 47) + 8 * dlc;
+}
+
+static int open_adapter(struct adapter *a, int idx, const char *link)
+{
+	struct termios tio;
+	char *name;
+
+	a->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (a->master < 0)
+		return -1;
+
+	if (grantpt(a->master) < 0 || unlockpt(a->master) < 0)
+		goto err_master;
+
+	name = ptsname(a->master);
+	if (!name)
+		goto err_master;
+	snprintf(a->name, sizeof(a->name), "%s", name);
+
+	a->slave = open(a->name, O_RDWR | O_NOCTTY);
+	if (a->slave < 0)
+		goto err_master;
+
+	/* no echo or line editing before hlcand sets the tty up */
+	if (tcgetattr(a->slave, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(a->slave, TCSANOW, &tio);
+	}
+
+	if (link) {
+		snprintf(a->link, sizeof(a->link), "%s%d", link, idx);
+		unlink(a->link);
+		if (symlink(a->name, a->link) < 0) {
+			perror(a->link);
+			a->link[0] = '\0';
+		}
+	}
+
+	return 0;
+
+err_master:
+	close(a->master);
+	return -1;
+}
+
+static void close_adapter(struct adapter *a)
+{
+	if (a->link[0])
+		unlink(a->link);
+	close(a->slave);
+	close(a->master);
+}
+
+/* queue bytes for the host, a full FIFO loses whole packets like the adapter */
+static void adapter_send(struct adapter *a, const unsigned char *buf, int len)
+{
+	if (a->out_len + len > ADAPTER_FIFO) {
+		a->lost_frames++;
+		return;
+	}
+	memcpy(a->out + a->out_len, buf, len);
+	a->out_len += len;
+}
+
+static void adapter_flush(struct adapter *a)
+{
+	ssize_t n;
+
+	if (!a->out_len)
+		return;
+
+	n = write(a->master, a->out, a->out_len);
+	if (n <= 0)
+		return;
+	memmove(a->out, a->out + n, a->out_len - n);
+	a->out_len -= n;
+}
+
+/* a frame came off the bus, hand it to the host with any pending fault */
+static void adapter_receive(struct adapter *a, const unsigned char *frame,
+			    int len)
+{
+	unsigned char buf[HLCAN_DATA_FRAME_MAX];
+	int cut;
+
+	if (a->drop) {
+		a->drop--;
+		a->lost_frames++;
+		return;
+	}
+
+	memcpy(buf, frame, len);
+	if (a->corrupt) {
+		a->corrupt--;
+		a->corrupted++;
+		buf[rand() % len] ^= 1 << (rand() % 8);
+	}
+
+	if (a->overflow) {
+		/* keep head and tail, the bytes between never reach the host */
+		cut = a->overflow < len - 2 ? a->overflow : len - 2;
+		a->overflow -= cut;
+		adapter_send(a, buf, 1);
+		adapter_send(a, buf + 1 + cut, len - 1 - cut);
+		a->lost_frames++;
+		return;
+	}
+
+	adapter_send(a, buf, len);
+	a->rx_frames++;
+}
+
+/* put a frame on the bus, it arrives once the bus had time to carry it */
+static void bus_transmit(int src, const unsigned char *buf, int len)
+{
+	struct bus_frame *f;
+	double now = now_us();
+
+	if (bus_head - bus_tail >= BUS_QUEUE) {
+		if (src >= 0)
+			adapters[src].lost_frames++;
+		return;
+	}
+
+	if (bus_free_us < now)
+		bus_free_us = now;
+	bus_free_us += frame_bits(buf) * 1e6 / bus_bitrate;
+
+	f = &bus[bus_head++ % BUS_QUEUE];
+	f->at_us = bus_free_us;
+	f->src = src;
+	f->len = len;
+	memcpy(f->buf, buf, len);
+}
+
+static int adapter_on_bus(const struct adapter *a)
+{
+	return a->speed == bus_speed;
+}
+
+static void bus_deliver(double now)
+{
+	struct bus_frame *f;
+	struct adapter *a;
+	int i;
+
+	while (bus_tail != bus_head) {
+		f = &bus[bus_tail % BUS_QUEUE];
+		if (f->at_us > now)
+			break;
+
+		for (i = 0; i < n_adapters; i++) {
+			a = &adapters[i];
+			if (!adapter_on_bus(a))
+				continue;
+			if (i == f->src && !echo)
+				continue;
+			adapter_receive(a, f->buf, f->len);
+		}
+		bus_tail++;
+	}
+}
+
+static void adapter_status_reply(struct adapter *a)
+{
+	unsigned char buf[HLCAN_CFG_PACKAGE_LEN];
+
+	hlcan_status_packet(buf);
+	buf[HLCAN_STATUS_REC_IDX] = a->rec;
+	buf[HLCAN_STATUS_TEC_IDX] = a->tec;
+	buf[HLCAN_STATUS_FLAGS_IDX] = a->status_flags;
+	buf[HLCAN_CFG_PACKAGE_LEN - 1] = hlcan_cfg_crc(buf);
+	adapter_send(a, buf, sizeof(buf));
+}
+
+/* settings and status requests, built by hlcan_cfg_packet() and hlcan_status_packet() */
+static void adapter_config(struct adapter *a, int idx)
+{
+	unsigned char *p = a->in.buf;
+	unsigned int i;
+
+	if (p[HLCAN_CFG_PACKAGE_LEN - 1] != hlcan_cfg_crc(p)) {
+		a->bad_packets++;
+		return;
+	}
+
+	if (p[2] == HLCAN_CFG_TYPE_STATUS) {
+		if (!no_status)
+			adapter_status_reply(a);
+		return;
+	}
+	if (p[2] != HLCAN_CFG_TYPE_SETTINGS) {
+		a->bad_packets++;
+		return;
+	}
+
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+		if (speeds[i].speed == p[3])
+			break;
+	if (i == sizeof(speeds) / sizeof(speeds[0]) ||
+	    (p[4] != HLCAN_FRAME_STANDARD && p[4] != HLCAN_FRAME_EXTENDED) ||
+	    p[13] > HLCAN_MODE_LOOPBACK_SILENT) {
+		a->bad_packets++;
+		return;
+	}
+
+	a->speed = p[3];
+	a->frame_type = p[4];
+	a->mode = p[13];
+	a->status_flags = 0;
+	a->cfg_packets++;
+	printf("adapter %d: %d bit/s, mode %d, %s ids%s\n", idx,
+	       speeds[i].bitrate, a->mode,
+	       a->frame_type == HLCAN_FRAME_EXTENDED ? "extended" : "standard",
+	       a->speed == bus_speed ? "" : " (not the bus bitrate)");
+	fflush(stdout);
+}
+
+static void adapter_frame(struct adapter *a, int idx, int len)
+{
+	if (!a->speed)
+		return;
+
+	a->tx_frames++;
+	if (a->mode & HLCAN_MODE_LOOPBACK) {
+		/* internal loopback, the bus never sees the frame */
+		adapter_send(a, a->in.buf, len);
+		return;
+	}
+	if (a->mode & HLCAN_MODE_SILENT || !adapter_on_bus(a))
+		return;
+	bus_transmit(idx, a->in.buf, len);
+}
+
+/* parse what the host wrote, the same way the ldisc parses the adapter */
+static void adapter_read(struct adapter *a, int idx)
+{
+	unsigned char buf[4096];
+	ssize_t n;
+	int i, len;
+
+	n = read(a->master, buf, sizeof(buf));
+	if (n <= 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		switch (hlcan_rx_byte(&a->in, buf[i], &len)) {
+		case HLCAN_RX_MORE:
+		case HLCAN_RX_SKIPPED:
+			break;
+		case HLCAN_RX_PACKET:
+			if (a->in.buf[1] == HLCAN_CFG_PACKAGE_TYPE)
+				adapter_config(a, idx);
+			else
+				adapter_frame(a, idx, len);
+			break;
+		default:
+			a->bad_packets++;
+			break;
+		}
+	}
+}
+
+static void generate_frame(void)
+{
+	unsigned char buf[HLCAN_DATA_FRAME_MAX], data[8];
+	int len, i;
+
+	/* a counter as payload, on a handful of ids */
+	for (i = 0; i < 8; i++)
+		data[i] = gen_frames >> (i * 8);
+	len = hlcan_data_frame(buf, 0x100 + gen_frames % 16, 0, 0, 8, data);
+	gen_frames++;
+	bus_transmit(-1, buf, len);
+}
+
+static void generate(double now)
+{
+	/* full load: keep a few frames ahead of the bus */
+	if (gen_rate < 0) {
+		while (bus_head - bus_tail < 4)
+			generate_frame();
+		return;
+	}
+
+	if (!gen_rate || gen_next_us > now)
+		return;
+
+	/* do not catch up on frames missed while we were stalled */
+	if (gen_next_us < now - 100000)
+		gen_next_us = now;
+	while (gen_next_us <= now) {
+		generate_frame();
+		gen_next_us += 1e6 / gen_rate;
+	}
+}
+
+static void print_stats(void)
+{
+	struct adapter *a;
+	int i;
+
+	printf("bus %d bit/s: %lu generated, %u in flight\n", bus_bitrate,
+	       gen_frames, bus_head - bus_tail);
+	for (i = 0; i < n_adapters; i++) {
+		a = &adapters[i];
+		printf("adapter %d %s: tx %lu rx %lu cfg %lu bad %lu lost %lu corrupted %lu\n",
+		       i, a->name, a->tx_frames, a->rx_frames, a->cfg_packets,
+		       a->bad_packets, a->lost_frames, a->corrupted);
+	}
+	fflush(stdout);
+}
+
+static int parse_rate(const char *arg, double *rate)
+{
+	char *end;
+
+	if (!strcmp(arg, "max")) {
+		*rate = -1;
+		return 0;
+	}
+	*rate = strtod(arg, &end);
+	return *end || *rate < 0 ? -1 : 0;
+}
+
+/* one command per line, see print_commands() */
+static void command(char *line)
+{
+	char cmd[16], arg[16];
+	int v1, v2, target = -1, n, i;
+	struct adapter *a;
+
+	n = sscanf(line, "%15s %d %d %d", cmd, &v1, &v2, &target);
+	if (n < 1)
+		return;
+
+	if (!strcmp(cmd, "quit")) {
+		running = 0;
+		return;
+	}
+	if (!strcmp(cmd, "stats")) {
+		print_stats();
+		return;
+	}
+	if (!strcmp(cmd, "gen")) {
+		if (sscanf(line, "%*s %15s", arg) != 1 ||
+		    parse_rate(arg, &gen_rate) < 0)
+			printf("gen <rate|max>\n");
+		gen_next_us = now_us();
+		return;
+	}
+
+	/* the adapter index is the last number, if there is one more */
+	if (!strcmp(cmd, "busoff")) {
+		target = n >= 2 ? v1 : -1;
+	} else if (!strcmp(cmd, "errors")) {
+		if (n < 3) {
+			print_commands();
+			return;
+		}
+	} else if (!strcmp(cmd, "corrupt") || !strcmp(cmd, "drop") ||
+		   !strcmp(cmd, "overflow")) {
+		if (n < 2) {
+			print_commands();
+			return;
+		}
+		target = n >= 3 ? v2 : -1;
+	} else {
+		print_commands();
+		return;
+	}
+
+	for (i = 0; i < n_adapters; i++) {
+		if (target >= 0 && i != target)
+			continue;
+		a = &adapters[i];
+		if (!strcmp(cmd, "corrupt"))
+			a->corrupt += v1;
+		else if (!strcmp(cmd, "drop"))
+			a->drop += v1;
+		else if (!strcmp(cmd, "overflow"))
+			a->overflow += v1;
+		else if (!strcmp(cmd, "errors")) {
+			a->rec = v1;
+			a->tec = v2;
+		} else if (!strcmp(cmd, "busoff")) {
+			a->status_flags |= HLCAN_STATUS_BUS_OFF;
+			a->tec = 255;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd[MAX_ADAPTERS + 1];
+	char *link = NULL, line[256], *nl;
+	int stdin_open = 1, line_len = 0;
+	struct timespec ts;
+	double now, timeout;
+	unsigned int j;
+	int opt, i, n;
+	ssize_t r;
+
+	while ((opt = getopt(argc, argv, "n:s:eg:L:N?h")) != -1) {
+		switch (opt) {
+		case 'n':
+			n_adapters = atoi(optarg);
+			if (n_adapters <= 0 || n_adapters > MAX_ADAPTERS)
+				print_usage(argv[0]);
+			break;
+		case 's':
+			bus_bitrate = atoi(optarg);
+			for (j = 0; j < sizeof(speeds) / sizeof(speeds[0]); j++)
+				if (speeds[j].bitrate == bus_bitrate)
+					break;
+			if (j == sizeof(speeds) / sizeof(speeds[0]))
+				print_usage(argv[0]);
+			bus_speed = speeds[j].speed;
+			break;
+		case 'e':
+			echo = 1;
+			break;
+		case 'g':
+			if (parse_rate(optarg, &gen_rate) < 0)
+				print_usage(argv[0]);
+			break;
+		case 'L':
+			link = optarg;
+			break;
+		case 'N':
+			no_status = 1;
+			break;
+		case 'h':
+		case '?':
+		default:
+			print_usage(argv[0]);
+			break;
+		}
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < n_adapters; i++) {
+		if (open_adapter(&adapters[i], i, link) < 0) {
+			perror("pty");
+			while (i--)
+				close_adapter(&adapters[i]);
+			return EXIT_FAILURE;
+		}
+		printf("adapter %d: %s%s%s\n", i, adapters[i].name,
+		       adapters[i].link[0] ? " " : "", adapters[i].link);
+	}
+	fflush(stdout);
+
+	gen_next_us = now_us();
+	while (running) {
+		now = now_us();
+		generate(now);
+		bus_deliver(now);
+
+		n = 0;
+		for (i = 0; i < n_adapters; i++) {
+			adapter_flush(&adapters[i]);
+			pfd[n].fd = adapters[i].master;
+			pfd[n].events = POLLIN;
+			if (adapters[i].out_len)
+				pfd[n].events |= POLLOUT;
+			n++;
+		}
+		pfd[n].fd = stdin_open ? STDIN_FILENO : -1;
+		pfd[n].events = POLLIN;
+
+		/* wake up for the next frame due on the bus or the generator */
+		timeout = 100000;
+		if (bus_tail != bus_head)
+			timeout = bus[bus_tail % BUS_QUEUE].at_us - now;
+		if (gen_rate > 0 && gen_next_us - now < timeout)
+			timeout = gen_next_us - now;
+		if (timeout < 0)
+			timeout = 0;
+
+		/* frames take a few 100 us at high bitrates, so no ms poll */
+		ts.tv_sec = timeout / 1e6;
+		ts.tv_nsec = (timeout - ts.tv_sec * 1e6) * 1e3;
+		if (ppoll(pfd, n + 1, &ts, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		for (i = 0; i < n_adapters; i++)
+			if (pfd[i].revents & POLLIN)
+				adapter_read(&adapters[i], i);
+
+		if (pfd[n].revents & (POLLIN | POLLHUP)) {
+			r = read(STDIN_FILENO, line + line_len,
+				 sizeof(line) - 1 - line_len);
+			if (r <= 0) {
+				stdin_open = 0;
+				continue;
+			}
+			line_len += r;
+			line[line_len] = '\0';
+			while ((nl = strchr(line, '\n'))) {
+				*nl = '\0';
+				command(line);
+				line_len -= nl + 1 - line;
+				memmove(line, nl + 1, line_len + 1);
+			}
+			if (line_len == sizeof(line) - 1)
+				line_len = 0;
+		}
+	}
+
+	print_stats();
+	for (i = 0; i < n_adapters; i++)
+		close_adapter(&adapters[i]);
+
+	return EXIT_SUCCESS;
+}
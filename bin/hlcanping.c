@@ -0,0 +1,479 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * hlcanping.c - round trip latency of hlcan channels
+ *
+ * Sends time stamped frames and waits for them to come back. A channel
+ * whose adapter is in loopback mode (hlcand -m 1) sends every frame back
+ * by itself. With a peer, two adapters wired to the same bus, the peer
+ * answers every ping with a pong, so a round trip crosses the bus twice.
+ *
+ * The payload of a ping is its sequence number and the low 32 bits of the
+ * CLOCK_MONOTONIC time it was sent in ns, both little endian. Frames sent
+ * from this host are not received back locally (CAN_RAW_LOOPBACK off),
+ * only what came in over an adapter counts.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define MAX_CHANNELS	16
+
+#define DEFAULT_ID	0x7a0
+
+struct pinger {
+	const char *ifname;
+	int sock;
+	int peer_sock;			/* answers the pings, -1 without peer */
+	canid_t reply_id;
+
+	unsigned long sent;
+	unsigned long received;
+	unsigned long late;		/* came back after the timeout */
+	unsigned long duplicates;
+	unsigned long reordered;
+	unsigned long foreign;		/* reply id, but not one of ours */
+	long highest;			/* highest sequence number back so far */
+	unsigned long long last_tx;
+	int outstanding;
+
+	unsigned char *seen;		/* one byte per sequence number */
+	double *rtt;			/* us, warm-up excluded */
+	unsigned long n_rtt;
+	double last_rtt;
+	double jitter;			/* sum of differences of successive rtts */
+	unsigned long n_jitter;
+};
+
+static struct pinger pingers[MAX_CHANNELS];
+static int n_pingers;
+
+static volatile int running = 1;
+
+static canid_t ping_id = DEFAULT_ID;
+static unsigned long count = 1000;
+static unsigned long warmup = 100;
+static long interval_us = 1000;
+static long timeout_ms = 1000;
+static int busy_poll;
+static int verbose;
+
+static void print_usage(char *prg)
+{
+	fprintf(stderr, "\nUsage: %s [options] <canif> [<canif> ...]\n\n", prg);
+	fprintf(stderr, "Options: -c <n>     (pings after the warm-up, default 1000)\n");
+	fprintf(stderr, "         -w <n>     (warm-up pings left out of the statistics, default 100)\n");
+	fprintf(stderr, "         -i <us>    (interval, default 1000, 0 sends once the last one is back)\n");
+	fprintf(stderr, "         -t <ms>    (replies later than this are lost, default 1000)\n");
+	fprintf(stderr, "         -I <id>    (CAN id of the pings in hex, default 7a0, pongs use id + 1)\n");
+	fprintf(stderr, "                    (ids above 7fe are sent as extended ids)\n");
+	fprintf(stderr, "         -p <peer>  (peer canif on the same bus answers, for one canif only)\n");
+	fprintf(stderr, "         -b         (busy poll the sockets instead of sleeping)\n");
+	fprintf(stderr, "         -v         (print every reply)\n");
+	fprintf(stderr, "         -h         (show this help page)\n");
+	fprintf(stderr, "\nThe adapters of the canifs have to be in loopback mode without a peer.\n");
+	fprintf(stderr, "\nExamples:\n");
+	fprintf(stderr, "hlcanping -c 10000 -i 0 -b hlcan0\n");
+	fprintf(stderr, "hlcanping hlcan0 hlcan1 hlcan2\n");
+	fprintf(stderr, "hlcanping -p hlcan1 hlcan0\n");
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+static void sig_handler(int signum)
+{
+	if (signum == SIGINT || signum == SIGTERM)
+		running = 0;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put_le32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static unsigned int get_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/* raw socket on ifname that only sees frames with id that came over the bus */
+static int open_socket(const char *ifname, canid_t id)
+{
+	struct can_filter filter = {
+		.can_id = id,
+		.can_mask = (id & CAN_EFF_FLAG ? CAN_EFF_MASK : CAN_SFF_MASK) |
+			    CAN_EFF_FLAG | CAN_RTR_FLAG,
+	};
+	struct sockaddr_can addr = { .can_family = AF_CAN };
+	int loopback = 0;
+	int s;
+
+	addr.can_ifindex = if_nametoindex(ifname);
+	if (!addr.can_ifindex) {
+		fprintf(stderr, "%s: %s\n", ifname, strerror(errno));
+		return -1;
+	}
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_LOOPBACK, &loopback, sizeof(loopback));
+	setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(filter));
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "%s: bind: %s\n", ifname, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static void send_ping(struct pinger *p, unsigned long long now)
+{
+	struct can_frame cf;
+
+	memset(&cf, 0, sizeof(cf));
+	cf.can_id = ping_id;
+	cf.can_dlc = 8;
+	put_le32(cf.data, p->sent);
+	put_le32(cf.data + 4, now);
+
+	if (write(p->sock, &cf, sizeof(cf)) != sizeof(cf)) {
+		/* a full queue loses the ping like the bus would */
+		if (errno != ENOBUFS && errno != EAGAIN)
+			fprintf(stderr, "%s: write: %s\n", p->ifname, strerror(errno));
+	}
+	p->sent++;
+	p->last_tx = now;
+	p->outstanding = 1;
+}
+
+/* the peer sends every ping back as pong */
+static void answer_pings(struct pinger *p)
+{
+	struct can_frame cf;
+
+	while (recv(p->peer_sock, &cf, sizeof(cf), MSG_DONTWAIT) == sizeof(cf)) {
+		cf.can_id = p->reply_id;
+		if (write(p->peer_sock, &cf, sizeof(cf)) != sizeof(cf))
+			fprintf(stderr, "%s: pong: %s\n", p->ifname, strerror(errno));
+	}
+}
+
+static void take_reply(struct pinger *p, const struct can_frame *cf,
+		       unsigned long long now)
+{
+	unsigned long seq;
+	double rtt;
+
+	if (cf->can_dlc != 8) {
+		p->foreign++;
+		return;
+	}
+	seq = get_le32(cf->data);
+	if (seq >= p->sent) {
+		p->foreign++;
+		return;
+	}
+	if (p->seen[seq]) {
+		p->duplicates++;
+		return;
+	}
+	p->seen[seq] = 1;
+	if ((long)seq < p->highest)
+		p->reordered++;
+	else
+		p->highest = seq;
+	if (seq == p->sent - 1)
+		p->outstanding = 0;
+
+	/* 32 bits of ns wrap after 4.29 s, longer than any timeout */
+	rtt = (unsigned int)((unsigned int)now - get_le32(cf->data + 4)) / 1e3;
+	if (rtt > timeout_ms * 1e3) {
+		p->late++;
+		return;
+	}
+	p->received++;
+
+	if (verbose)
+		printf("%s: seq=%lu rtt=%.1f us%s\n", p->ifname, seq, rtt,
+		       seq < warmup ? " (warm-up)" : "");
+	if (seq < warmup)
+		return;
+
+	p->rtt[p->n_rtt++] = rtt;
+	if (p->n_rtt > 1) {
+		p->jitter += fabs(rtt - p->last_rtt);
+		p->n_jitter++;
+	}
+	p->last_rtt = rtt;
+}
+
+static void read_replies(struct pinger *p)
+{
+	struct can_frame cf;
+
+	while (recv(p->sock, &cf, sizeof(cf), MSG_DONTWAIT) == sizeof(cf))
+		take_reply(p, &cf, now_ns());
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, unsigned long n, double q)
+{
+	return n ? v[(unsigned long)(q * (n - 1) + 0.5)] : 0;
+}
+
+static void print_stats(struct pinger *p)
+{
+	unsigned long measured = p->sent > warmup ? p->sent - warmup : 0;
+	unsigned long lost = p->sent - p->received;
+	double sum = 0, sq = 0, mean, sdev;
+	unsigned long i;
+
+	qsort(p->rtt, p->n_rtt, sizeof(double), cmp_double);
+	for (i = 0; i < p->n_rtt; i++) {
+		sum += p->rtt[i];
+		sq += p->rtt[i] * p->rtt[i];
+	}
+	mean = p->n_rtt ? sum / p->n_rtt : 0;
+	sdev = p->n_rtt ? sqrt(sq / p->n_rtt - mean * mean) : 0;
+
+	printf("--- %s hlcanping statistics ---\n", p->ifname);
+	printf("%lu pings sent (%lu warm-up), %lu back, %lu lost (%.2f%%), "
+	       "%lu late, %lu duplicates, %lu reordered, %lu foreign\n",
+	       p->sent, p->sent - measured, p->received, lost,
+	       p->sent ? 100.0 * lost / p->sent : 0, p->late, p->duplicates,
+	       p->reordered, p->foreign);
+	if (!p->n_rtt)
+		return;
+	printf("rtt min/avg/max/sdev = %.1f/%.1f/%.1f/%.1f us\n",
+	       p->rtt[0], mean, p->rtt[p->n_rtt - 1], sdev);
+	printf("rtt p50/p90/p99/p99.9 = %.1f/%.1f/%.1f/%.1f us, jitter %.1f us\n",
+	       percentile(p->rtt, p->n_rtt, 0.5),
+	       percentile(p->rtt, p->n_rtt, 0.9),
+	       percentile(p->rtt, p->n_rtt, 0.99),
+	       percentile(p->rtt, p->n_rtt, 0.999),
+	       p->n_jitter ? p->jitter / p->n_jitter : 0);
+}
+
+/* all pings sent and back or given up on */
+static int done(unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < n_pingers; i++) {
+		struct pinger *p = &pingers[i];
+
+		if (p->sent < warmup + count)
+			return 0;
+		if (p->received + p->late < p->sent &&
+		    now - p->last_tx < timeout_ms * 1000000ULL)
+			return 0;
+	}
+	return 1;
+}
+
+static void run(void)
+{
+	struct pollfd pfd[2 * MAX_CHANNELS];
+	unsigned long long now, next = now_ns();
+	unsigned long long timeout_ns = timeout_ms * 1000000ULL;
+	struct timespec ts;
+	long long wait;
+	int i, n;
+
+	while (running) {
+		now = now_ns();
+		if (done(now))
+			break;
+
+		for (i = 0; i < n_pingers; i++) {
+			struct pinger *p = &pingers[i];
+
+			if (p->sent >= warmup + count)
+				continue;
+			if (interval_us && now >= next)
+				send_ping(p, now);
+			else if (!interval_us &&
+				 (!p->outstanding || now - p->last_tx >= timeout_ns))
+				send_ping(p, now);
+		}
+		if (interval_us && now >= next) {
+			next += interval_us * 1000ULL;
+			/* do not catch up in a burst after a stall */
+			if (next < now)
+				next = now + interval_us * 1000ULL;
+		}
+
+		if (busy_poll) {
+			for (i = 0; i < n_pingers; i++) {
+				if (pingers[i].peer_sock >= 0)
+					answer_pings(&pingers[i]);
+				read_replies(&pingers[i]);
+			}
+			continue;
+		}
+
+		n = 0;
+		for (i = 0; i < n_pingers; i++) {
+			pfd[n].fd = pingers[i].sock;
+			pfd[n++].events = POLLIN;
+			if (pingers[i].peer_sock >= 0) {
+				pfd[n].fd = pingers[i].peer_sock;
+				pfd[n++].events = POLLIN;
+			}
+		}
+
+		/* until the next ping is due, without interval the next check */
+		wait = interval_us ? (long long)(next - now) : 1000000;
+		if (wait < 0)
+			wait = 0;
+		ts.tv_sec = wait / 1000000000LL;
+		ts.tv_nsec = wait % 1000000000LL;
+		if (ppoll(pfd, n, &ts, NULL) <= 0)
+			continue;
+
+		for (i = 0; i < n_pingers; i++) {
+			if (pingers[i].peer_sock >= 0)
+				answer_pings(&pingers[i]);
+			read_replies(&pingers[i]);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *peer = NULL;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:w:i:t:I:p:bv?h")) != -1) {
+		switch (opt) {
+		case 'c':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			warmup = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			interval_us = atol(optarg);
+			if (interval_us < 0)
+				print_usage(argv[0]);
+			break;
+		case 't':
+			timeout_ms = atol(optarg);
+			/* rtts have to fit the 32 bit time stamp */
+			if (timeout_ms <= 0 || timeout_ms > 4000)
+				print_usage(argv[0]);
+			break;
+		case 'I':
+			ping_id = strtoul(optarg, NULL, 16);
+			if (ping_id > CAN_SFF_MASK - 1)
+				ping_id = (ping_id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+			break;
+		case 'p':
+			peer = optarg;
+			break;
+		case 'b':
+			busy_poll = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		case '?':
+		default:
+			print_usage(argv[0]);
+			break;
+		}
+	}
+
+	n_pingers = argc - optind;
+	if (!n_pingers || n_pingers > MAX_CHANNELS || (peer && n_pingers > 1) ||
+	    !count)
+		print_usage(argv[0]);
+
+	for (i = 0; i < n_pingers; i++) {
+		struct pinger *p = &pingers[i];
+
+		p->ifname = argv[optind + i];
+		p->highest = -1;
+		p->peer_sock = -1;
+		p->reply_id = peer ? ping_id + 1 : ping_id;
+		p->sock = open_socket(p->ifname, p->reply_id);
+		if (p->sock < 0)
+			return EXIT_FAILURE;
+		if (peer) {
+			p->peer_sock = open_socket(peer, ping_id);
+			if (p->peer_sock < 0)
+				return EXIT_FAILURE;
+		}
+		p->seen = calloc(warmup + count, 1);
+		p->rtt = malloc(count * sizeof(*p->rtt));
+		if (!p->seen || !p->rtt) {
+			perror("malloc");
+			return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	printf("HLCANPING id %03x, %lu + %lu warm-up pings%s%s\n",
+	       ping_id & CAN_EFF_MASK, count, warmup,
+	       peer ? ", answered by " : " in loopback", peer ? peer : "");
+	run();
+
+	for (i = 0; i < n_pingers; i++) {
+		print_stats(&pingers[i]);
+		close(pingers[i].sock);
+		if (pingers[i].peer_sock >= 0)
+			close(pingers[i].peer_sock);
+	}
+
+	for (i = 0; i < n_pingers; i++)
+		if (pingers[i].received + pingers[i].late < pingers[i].sent)
+			return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
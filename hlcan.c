@@ -45,9 +45,11 @@
 #include <linux/bitops.h>
 #include <linux/string.h>
 #include <linux/tty.h>
+#include <linux/tty_flip.h>
 #include <linux/errno.h>
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/rtnetlink.h>
 #include <linux/if_arp.h>
 #include <linux/if_ether.h>
@@ -56,29 +58,236 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/cpumask.h>
+#include <linux/sched/types.h>
+#include <linux/hash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/error-injection.h>
+#include <linux/miscdevice.h>
+#include <linux/ethtool.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/idr.h>
+#include <linux/rcupdate.h>
 #include <linux/can.h>
 #include <linux/can/dev.h>
+#include <linux/can/error.h>
 #include <linux/can/skb.h>
+#include <linux/can/can-ml.h>
 #include <linux/version.h>
 
 #include "hlcan.h"
 
+#define CREATE_TRACE_POINTS
+#include "hlcan_trace.h"
+
 MODULE_ALIAS_LDISC(N_HLCAN);
 MODULE_DESCRIPTION("hl340 CAN interface");
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alexander Mohr <hlcan@mohr.io>");
 
-static int maxdev = 10;		/* MAX number of SLCAN channels;
-				   This can be overridden with
-				   insmod slcan.ko maxdev=nnn	*/
-module_param(maxdev, int, 0);
-MODULE_PARM_DESC(maxdev, "Maximum number of hlcan interfaces");
-
-/* maximum rx buffer len: 20 should be enough as config command is largest cmd*/
+static int maxdev;		/* MAX number of HLCAN channels;
+				   0 means no limit. This can be changed
+				   at runtime in /sys/module/hlcan/parameters */
+module_param(maxdev, int, 0644);
+MODULE_PARM_DESC(maxdev, "Maximum number of hlcan interfaces (0 = unlimited)");
+
+static unsigned int status_poll_ms;	/* Adapter status poll interval;
+					   0 disables polling. Applies
+					   from the next ifup on	*/
+module_param(status_poll_ms, uint, 0644);
+MODULE_PARM_DESC(status_poll_ms, "Adapter error state poll interval in ms (0 = off), "
+		 "the adapter must answer status requests");
+
+static bool id_stats;		/* Keep per CAN ID statistics for
+				   channels attached from now on */
+module_param(id_stats, bool, 0644);
+MODULE_PARM_DESC(id_stats, "Keep per CAN ID statistics in debugfs");
+
+static bool latency;		/* Keep latency histograms for
+				   channels attached from now on */
+module_param(latency, bool, 0644);
+MODULE_PARM_DESC(latency, "Keep RX and TX latency histograms in debugfs");
+
+static bool rx_hook;		/* Call hlcan_rx_hook() for every
+				   received frame */
+module_param(rx_hook, bool, 0644);
+MODULE_PARM_DESC(rx_hook, "Run received frames through hlcan_rx_hook() for BPF");
+
+static bool raw_dev;		/* Give channels attached from now on
+				   a /dev/hlcan/<tty> raw device */
+module_param(raw_dev, bool, 0644);
+MODULE_PARM_DESC(raw_dev, "Create /dev/hlcan/<tty> with the raw adapter data");
+
+static bool monitor;		/* Pair channels attached from now on
+				   with a <dev>-mon interface */
+module_param(monitor, bool, 0644);
+MODULE_PARM_DESC(monitor, "Create a <dev>-mon interface seeing all frames of a channel");
+
+/* maximum tx buffer len: 20 should be enough as config command is largest cmd*/
 #define SLC_MTU (128)
 #define DRV_NAME			"hlcan"
+/* bits in flags */
 #define SLF_INUSE		0		/* Channel in use            */
-#define SLF_ERROR		1		/* Parity, etc. error        */
+#define SLF_CONFIG		2		/* Adapter command in xbuff  */
+#define SLF_TX_FRAME		6		/* Frame not counted yet     */
+/* bits in rx_flags */
+#define SLF_RESYNC		3		/* Restart the RX decoder    */
+#define SLF_THROTTLED		4		/* RX stopped, stack is full */
+#define SLF_GEN			5		/* Traffic generator feeds RX */
+
+/* how long a reconfiguration waits for the frame in flight */
+#define HLCAN_RECONFIG_TIMEOUT_MS	20
+/* how long RX stays throttled once the backlog filled up */
+#define HLCAN_RX_BACKOFF_MS		2
+/* frames of a channel handed to the stack and not freed yet that throttle RX */
+#define HLCAN_RX_BACKLOG_MAX		300
+
+/* ring between the tty and the RX thread, HLCAN_RX_SLOTS is a power of 2 */
+#define HLCAN_RX_SLOTS		64
+#define HLCAN_RX_CHUNK		256
+
+struct hlcan_rx_chunk {
+	u64			ts;		/* arrival, with latency set */
+	unsigned short		len;
+	unsigned char		err;		/* error flag after data     */
+	unsigned char		data[HLCAN_RX_CHUNK];
+};
+
+/* single producer (tty), single consumer (RX thread) */
+struct hlcan_rx_ring {
+	unsigned int		head;		/* written by the tty side   */
+	unsigned int		tail;		/* written by the RX thread  */
+	struct hlcan_rx_chunk	slot[HLCAN_RX_SLOTS];
+};
+
+/* per CAN ID statistics, open addressing with bounded probing */
+#define HLCAN_ID_BITS		10
+#define HLCAN_ID_SLOTS		(1 << HLCAN_ID_BITS)
+#define HLCAN_ID_PROBES		16
+
+struct hlcan_id_stat {
+	u32			id;		/* can_id incl. CAN_EFF_FLAG */
+	u64			frames;		/* 0 = slot is free          */
+	u64			bytes;
+	u64			last_ns;
+	u64			min_gap_ns;
+	u64			max_gap_ns;
+	u64			sum_gap_ns;
+	u32			dlc[CAN_MAX_DLEN + 1];
+};
+
+/* one writer each: the RX decoder or the TX path under tx_lock */
+struct hlcan_id_table {
+	unsigned long		overflow;	/* frames that found no slot */
+	struct hlcan_id_stat	slot[HLCAN_ID_SLOTS];
+};
+
+/*
+ * Latency histograms, bucket i counts samples below 2^i ns. Every stage
+ * has one writer at a time, so the counters need no atomics. A reset
+ * clears the bank not in use and switches cur over to it.
+ */
+#define HLCAN_LAT_BUCKETS	40
+
+enum hlcan_lat_stage {
+	HLCAN_LAT_RX_DECODE,		/* tty chunk -> frame decoded    */
+	HLCAN_LAT_RX_DELIVER,		/* frame decoded -> netif_rx()   */
+	HLCAN_LAT_RX_TOTAL,
+	HLCAN_LAT_TX_ACCEPT,		/* slc_xmit() -> tty took it     */
+	HLCAN_LAT_TX_DRAIN,		/* tty took it -> last byte out  */
+	HLCAN_LAT_TX_TOTAL,
+	HLCAN_LAT_STAGES
+};
+
+struct hlcan_lat_bank {
+	u64			count[HLCAN_LAT_STAGES][HLCAN_LAT_BUCKETS];
+	u64			max_ns[HLCAN_LAT_STAGES];
+};
+
+struct hlcan_lat {
+	struct mutex		reset_lock;
+	struct hlcan_lat_bank	*cur;
+	struct hlcan_lat_bank	bank[2];
+};
+
+/*
+ * RX change filter: per CAN ID the masked payload of the last frame that
+ * was passed on. Masks are replaced as a whole under RCU, gen tells the
+ * cache entries to pick up their mask again.
+ */
+#define HLCAN_MASKS_MAX		64
+
+struct hlcan_rx_mask {
+	u32			id;
+	u8			mask[CAN_MAX_DLEN];
+};
+
+struct hlcan_rx_masks {
+	struct rcu_head		rcu;
+	unsigned int		gen;
+	unsigned int		count;
+	struct hlcan_rx_mask	m[];
+};
+
+struct hlcan_change_entry {
+	u32			id;
+	unsigned int		gen;
+	bool			used;
+	u8			dlc;
+	u8			mask[CAN_MAX_DLEN];
+	u8			data[CAN_MAX_DLEN];	/* masked payload */
+	u64			last_ns;	/* last frame passed on      */
+};
+
+struct hlcan_change_table {
+	struct hlcan_change_entry slot[HLCAN_ID_SLOTS];
+};
+
+/* debugfs traffic generator, settings are read once per burst */
+#define HLCAN_GEN_BURST_MAX	256
+
+struct hlcan_gen {
+	struct mutex		lock;		/* start and stop            */
+	struct task_struct	*task;
+	unsigned char		*buf;
+	u32			rate;		/* frames/s, 0 = no limit    */
+	u32			burst;		/* frames fed at once        */
+	u32			id_base;
+	u32			id_count;	/* ids from id_base on       */
+	u32			ext_pct;	/* % of extended frames      */
+	u32			dlc_min;
+	u32			dlc_max;
+	u32			corrupt_ppm;	/* frames with a flipped byte */
+	u64			frames;
+	u64			bytes;
+	u64			corrupted;
+};
+
+/* raw passthrough device, outlives the channel while it is open */
+#define HLCAN_RAW_HDR_SIZE	PAGE_SIZE
+#define HLCAN_RAW_DATA_SIZE	(1 << 18)
+
+struct hlcan_raw {
+	struct kref		ref;
+	struct miscdevice	misc;
+	char			name[32];
+	char			nodename[32];
+	struct mutex		lock;		/* protects sl               */
+	struct slcan		*sl;		/* NULL once detached        */
+	struct hlcan_raw_ring	*ring;		/* header, data follows      */
+	wait_queue_head_t	wait;
+};
+
+enum hlcan_rx_sched {
+	HLCAN_RX_SCHED_NORMAL,
+	HLCAN_RX_SCHED_FIFO_LOW,
+	HLCAN_RX_SCHED_FIFO,
+};
 spinlock_t		global_lock;
 
 struct slcan {
@@ -86,23 +295,94 @@ struct slcan {
 	int magic;
 	struct tty_struct	*tty;		/* ptr to TTY structure	     */
 	struct net_device	*dev;		/* easy for intr handling    */
-	spinlock_t		lock;
 	struct work_struct	tx_work;	/* Flushes transmit buffer   */
+	struct delayed_work	status_work;	/* Polls the adapter status  */
+	struct delayed_work	rx_kick_work;	/* Ends an RX throttle       */
+
+	int candev_registered;
+	int mode;				/* HLCAN_MODE of the adapter */
+
+	HLCAN_SPEED		speed;		/* speed set via netlink     */
+	HLCAN_SPEED		cfg_speed;	/* speed of the adapter      */
+	HLCAN_FRAME_TYPE	frame_type;	/* frame type of the adapter */
+	struct can_berr_counter	bec;		/* last reported counters    */
+
+	/* Optional RX thread, settings are changed under rtnl */
+	struct task_struct __rcu *rx_task;	/* decodes rx_ring when set  */
+	struct hlcan_rx_ring	*rx_ring;
+	bool			rx_thread;	/* use a thread from ifup on */
+	int			rx_cpu;		/* -1 = any CPU              */
+	enum hlcan_rx_sched	rx_sched;
+	int			rx_nice;
+
+	struct dentry		*debugfs;	/* hlcan/<tty> in debugfs    */
+	struct net_device	*mon;		/* <dev>-mon or NULL         */
+	struct hlcan_gen	gen;
+	struct hlcan_raw	*raw;		/* /dev/hlcan/<tty> or NULL  */
+	struct hlcan_lat	*lat;		/* NULL without latency      */
+
+	/* RX change filter, changed under rtnl */
+	struct hlcan_change_table __rcu *rx_change;	/* NULL = off        */
+	struct hlcan_rx_masks __rcu *rx_masks;
+	unsigned int		rx_mask_gen;
+	unsigned int		rx_keepalive_ms; /* 0 = suppress forever     */
 
-	/* These are pointers to the malloc()ed frame buffers. */
-	unsigned char		rbuff[SLC_MTU];	/* receiver buffer	     */
-	int			rcount;         /* received chars counter    */
-	int			rexpected;	/* expected chars counter    */
-	FRAME_STATE 		rstate; 	/* state of current receive  */
+	/*
+	 * RX side. Only the tty work or the RX thread touch it, one at a
+	 * time, so it needs no lock.
+	 */
+	unsigned long		rx_flags ____cacheline_aligned_in_smp;
+	struct hlcan_rx		rx;		/* stream decoder	     */
+	u64			rx_pos;		/* bytes decoded, for tracing */
+	u64			rx_chunk_ns;	/* arrival of the last chunk */
+	unsigned long		rx_resyncs;	/* decoder restarts          */
+	unsigned long		rx_discarded;	/* bytes thrown away         */
+	unsigned long		rx_cfg_packets;	/* config and status packets */
+	unsigned long		rx_alloc_failed; /* no skb for a frame       */
+	struct u64_stats_sync	rx_syncp;
+	u64			rx_packets;
+	u64			rx_bytes;
+	struct hlcan_id_table	*rx_ids;	/* NULL without id_stats     */
+	unsigned long		rx_suppressed;	/* dropped by change filter  */
+	unsigned long		rx_hook_passed;
+	unsigned long		rx_hook_dropped;
+	unsigned long		rx_hook_redirected;
+	unsigned long		rx_hook_errors;	/* redirect target unusable  */
+
+	/* RX backpressure, see hlcan_rx_throttle() */
+	ktime_t			rx_throttle_start;
+	unsigned long		rx_throttled;	/* times RX was throttled    */
+	u64			rx_throttled_us; /* total time throttled     */
+	unsigned int		rx_backlog_hwm;	/* most bytes left unread    */
+	atomic_t		rx_pending;	/* frames the stack still has */
+
+	/* TX side, serialized by tx_lock */
+	spinlock_t		tx_lock ____cacheline_aligned_in_smp;
+	unsigned long		flags;		/* Flag values/ mode etc     */
 	unsigned char		xbuff[SLC_MTU];	/* transmitter buffer	     */
 	unsigned char		*xhead;         /* pointer to next XMIT byte */
 	int			xleft;          /* bytes left in XMIT queue  */
-
-	unsigned long		flags;		/* Flag values/ mode etc     */
-	int candev_registered;
-	int mode;
+	u64			tx_pos;		/* bytes written, for tracing */
+	u64			tx_start_ns;	/* slc_xmit() of the frame   */
+	u64			tx_accept_ns;	/* tty took the frame        */
+	unsigned long		tx_partial;	/* frames the tty took in part */
+	unsigned long		tx_wakeups;	/* slcan_transmit() runs     */
+	struct u64_stats_sync	tx_syncp;
+	u64			tx_packets;
+	u64			tx_bytes;
+	struct hlcan_id_table	*tx_ids;	/* NULL without id_stats     */
 };
 
+static struct dentry *hlcan_debugfs;	/* hlcan/ in debugfs */
+
+/*
+ * The adapter takes a speed index rather than bit timing, so this only
+ * needs to let can_calc_bittiming() find something for every bitrate
+ * in hlcan_speeds below. It matches the bxCAN at 36 MHz behind the
+ * HL-340 serial converter.
+ */
+#define HLCAN_CLOCK_FREQ	36000000
+
 static const struct can_bittiming_const hlcan_bittiming_const = {
 	.name = DRV_NAME,
 	.tseg1_min = 2,
@@ -111,34 +391,39 @@ static const struct can_bittiming_const hlcan_bittiming_const = {
 	.tseg2_max = 8,
 	.sjw_max = 4,
 	.brp_min = 1,
-	.brp_max = 64,
+	.brp_max = 1024,
 	.brp_inc = 1,
 };
 
-static struct net_device **slcan_devs;
+/* Bitrates the adapter can be set to */
+static const struct {
+	u32 bitrate;
+	HLCAN_SPEED speed;
+} hlcan_speeds[] = {
+	{ 1000000, HLCAN_SPEED_1000000 },
+	{  800000, HLCAN_SPEED_800000 },
+	{  500000, HLCAN_SPEED_500000 },
+	{  400000, HLCAN_SPEED_400000 },
+	{  250000, HLCAN_SPEED_250000 },
+	{  200000, HLCAN_SPEED_200000 },
+	{  125000, HLCAN_SPEED_125000 },
+	{  100000, HLCAN_SPEED_100000 },
+	{   50000, HLCAN_SPEED_50000 },
+	{   20000, HLCAN_SPEED_20000 },
+	{   10000, HLCAN_SPEED_10000 },
+	{    5000, HLCAN_SPEED_5000 },
+};
+
+/* Channel registry, maps channel numbers to netdevs. Protected by global_lock */
+static DEFINE_IDR(slcan_idr);
 
 /*
  * Protocol handling
  */
-#define CHECK_BIT(var,pos) ((var) & (1<<(pos)))
-
-#define IS_EXT_ID(type)(CHECK_BIT(type, 5))
-#define IS_REMOTE(type)(CHECK_BIT(type, 4))
-		
 /* checks if bit 7 and 6 is set */
 #define IS_DATA_PACKAGE(type) ({ \
 		((type >> 6) ^ 3) == 0;})
 
-#define GET_FRAME_ID(frame)({ 	   		\
-	 IS_EXT_ID(frame[1]) 			\
-		?	(frame[5] << 24) |	\
-			(frame[4] << 16) |	\
-			(frame[3] << 8)  |	\
-			(frame[2])		\
-		: 	((frame[3] << 8) |	\
-			frame[2]);})
-
-#define GET_DLC(type) ({type & 0x0f;})
 
 
 
@@ -176,347 +461,2350 @@ static struct net_device **slcan_devs;
   *			STANDARD SLCAN DECAPSULATION			 *
   ************************************************************************/
 
-/* Send one completely decapsulated can_frame to the network layer */
-static void slc_bump(struct slcan *sl)
+/*
+ * The stack falls behind, so stop taking bytes from the tty for a
+ * moment. They stay in the flip buffers and the serial driver is told
+ * to stop reading from the adapter. hlcan_rx_kick() lets the data flow
+ * again. As long as this kicks in before the backlog is full, see
+ * hlcan_rx_deliver(), the overload is delay rather than loss.
+ */
+static void hlcan_rx_throttle(struct slcan *sl)
 {
-	struct sk_buff *skb;
-	struct can_frame cf;
-	unsigned char data_start = 3;
-	/* idx 0 = packet header, skip it */
-	unsigned char *cmd = sl->rbuff + 1;
-	
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
-	cf.len = GET_DLC(*cmd);
-#else
-	cf.can_dlc = GET_DLC(*cmd);
-#endif
-	cf.can_id = GET_FRAME_ID(sl->rbuff);
-	
-	if (IS_REMOTE(*cmd)){
-		cf.can_id |= CAN_RTR_FLAG;
-	}
+	if (test_and_set_bit(SLF_THROTTLED, &sl->rx_flags))
+		return;
 
-	if (IS_EXT_ID(*cmd)) {
-		cf.can_id |= CAN_EFF_FLAG;
-		data_start = 5;
+	sl->rx_throttle_start = ktime_get();
+	sl->rx_throttled++;
+
+	schedule_delayed_work(&sl->rx_kick_work,
+			      msecs_to_jiffies(HLCAN_RX_BACKOFF_MS));
+}
+
+static void hlcan_rx_kick(struct work_struct *work)
+{
+	struct slcan *sl = container_of(to_delayed_work(work), struct slcan,
+					rx_kick_work);
+	struct tty_struct *tty = sl->tty;
+
+	sl->rx_throttled_us += ktime_us_delta(ktime_get(),
+					      sl->rx_throttle_start);
+	clear_bit(SLF_THROTTLED, &sl->rx_flags);
+	/* pairs with hlcan_tty_throttle() */
+	smp_mb__after_atomic();
+
+	if (!tty)
+		return;
+
+	tty_unthrottle(tty);
+
+	/* Unlocking the flip buffers requeues them if data is pending */
+	if (tty->port) {
+		tty_buffer_lock_exclusive(tty->port);
+		tty_buffer_unlock_exclusive(tty->port);
 	}
+}
 
-	*(u64 *) (&cf.data) = 0; /* clear payload */
-	/* RTR frames may have a dlc > 0 but they never have any data bytes */
-	if (!(cf.can_id & CAN_RTR_FLAG)) {
-		memcpy(cf.data, 
-			cmd + data_start,
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
-			cf.len);
-#else
-			cf.can_dlc);
+/* Frames are delivered from the tty work or from the RX thread */
+static int hlcan_netif_rx(struct sk_buff *skb)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,18,0)
+	if (!in_interrupt())
+		return netif_rx_ni(skb);
 #endif
-	}
+	return netif_rx(skb);
+}
 
-	skb = dev_alloc_skb(sizeof(struct can_frame) +
-			    sizeof(struct can_skb_priv));
-	if (!skb)
-		return;
+/* The stack is done with a frame of ours, clones do not inherit this */
+static void hlcan_rx_skb_free(struct sk_buff *skb)
+{
+	struct slcan *sl = netdev_priv(skb->dev);
 
-	skb->dev = sl->dev;
-	skb->protocol = htons(ETH_P_CAN);
-	skb->pkt_type = PACKET_BROADCAST;
-	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	atomic_dec(&sl->rx_pending);
+}
 
-	can_skb_reserve(skb);
-	can_skb_prv(skb)->ifindex = sl->dev->ifindex;
-	can_skb_prv(skb)->skbcnt = 0;
+/*
+ * Hand a frame to the stack, false if it was dropped. rx_pending counts
+ * the frames of this channel that sit in the backlog or are still being
+ * processed. RX is throttled once HLCAN_RX_BACKLOG_MAX of them pile up,
+ * so the next bytes wait in the tty. netif_rx() drops frames once
+ * net.core.netdev_max_backlog frames of any device wait on the CPU, that
+ * throttles RX as well. The RX thread finishes its chunk first, which
+ * is a few dozen frames at most.
+ */
+static bool hlcan_rx_deliver(struct slcan *sl, struct sk_buff *skb)
+{
+	skb->destructor = hlcan_rx_skb_free;
+	if (atomic_inc_return(&sl->rx_pending) >= HLCAN_RX_BACKLOG_MAX)
+		hlcan_rx_throttle(sl);
+
+	if (hlcan_netif_rx(skb) == NET_RX_DROP) {
+		sl->dev->stats.rx_dropped++;
+		hlcan_rx_throttle(sl);
+		return false;
+	}
 
-	skb_put_data(skb, &cf, sizeof(struct can_frame));
+	return true;
+}
 
-	sl->dev->stats.rx_packets++;
+/************************************************************************
+ *			PER-ID STATISTICS				*
+ ************************************************************************/
+
+/*
+ * Account a frame to its CAN ID. Each table has a single writer, so no
+ * lock is taken. Readers in debugfs may see an entry half updated, which
+ * is fine for statistics. IDs that find no slot within HLCAN_ID_PROBES
+ * are only counted as overflow.
+ */
+static void hlcan_id_account(struct hlcan_id_table *t,
+			     const struct can_frame *cf)
+{
+	u32 id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	unsigned int i, h = hash_32(id, HLCAN_ID_BITS);
+	struct hlcan_id_stat *e;
+	u64 now, gap;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
-	sl->dev->stats.rx_bytes += cf.len;
+	u8 dlc = min_t(u8, cf->len, CAN_MAX_DLEN);
 #else
-	sl->dev->stats.rx_bytes += cf.can_dlc;
+	u8 dlc = min_t(u8, cf->can_dlc, CAN_MAX_DLEN);
 #endif
-	netif_rx(skb);
+
+	for (i = 0; i < HLCAN_ID_PROBES; i++) {
+		e = &t->slot[(h + i) & (HLCAN_ID_SLOTS - 1)];
+		if (!e->frames) {
+			e->id = id;
+			e->min_gap_ns = U64_MAX;
+			/* readers check frames before they look at id */
+			smp_wmb();
+			break;
+		}
+		if (e->id == id)
+			break;
+	}
+	if (i == HLCAN_ID_PROBES) {
+		t->overflow++;
+		return;
+	}
+
+	now = ktime_get_ns();
+	if (e->frames) {
+		gap = now - e->last_ns;
+		if (gap < e->min_gap_ns)
+			e->min_gap_ns = gap;
+		if (gap > e->max_gap_ns)
+			e->max_gap_ns = gap;
+		e->sum_gap_ns += gap;
+	}
+	e->last_ns = now;
+	e->bytes += dlc;
+	e->dlc[dlc]++;
+	WRITE_ONCE(e->frames, e->frames + 1);
 }
 
-/* get the state of the current receive transmission */
-static void hlcan_update_rstate(struct slcan *sl)
+/* copy an entry for a reader, returns false for a free slot */
+static bool hlcan_id_read(const struct hlcan_id_stat *e,
+			  struct hlcan_id_record *rec)
 {
-	if (sl->rcount > 0) {
-		if (sl->rbuff[0] != HLCAN_PACKET_START) {
-			/* Need to sync on 0xaa at start of frames, so just skip. */
-			sl->rstate = MISSED_HEADER;
-			 return;
-		}
+	u64 frames = READ_ONCE(e->frames);
+	int i;
+
+	if (!frames)
+		return false;
+	smp_rmb();
+
+	memset(rec, 0, sizeof(*rec));
+	rec->id = e->id;
+	rec->frames = frames;
+	rec->bytes = e->bytes;
+	rec->last_ns = e->last_ns;
+	if (frames > 1) {
+		rec->min_gap_ns = e->min_gap_ns;
+		rec->max_gap_ns = e->max_gap_ns;
+		rec->mean_gap_ns = div64_u64(e->sum_gap_ns, frames - 1);
 	}
+	for (i = 0; i <= CAN_MAX_DLEN; i++)
+		rec->dlc[i] = e->dlc[i];
+
+	return true;
+}
+
+static void hlcan_id_show_table(struct seq_file *m, const char *dir,
+				const struct hlcan_id_table *t)
+{
+	struct hlcan_id_record rec;
+	int i, j;
 
-	if (sl->rcount < 2) {
-		sl->rstate = RECEIVING;
+	if (!t)
 		return;
+
+	for (i = 0; i < HLCAN_ID_SLOTS; i++) {
+		if (!hlcan_id_read(&t->slot[i], &rec))
+			continue;
+		seq_printf(m, "%s %8x %10llu %10llu %12llu %10llu %10llu %10llu",
+			   dir, rec.id, rec.frames, rec.bytes, rec.last_ns,
+			   rec.min_gap_ns / NSEC_PER_USEC,
+			   rec.mean_gap_ns / NSEC_PER_USEC,
+			   rec.max_gap_ns / NSEC_PER_USEC);
+		for (j = 0; j <= CAN_MAX_DLEN; j++)
+			seq_printf(m, " %u", rec.dlc[j]);
+		seq_putc(m, '\n');
 	}
+	seq_printf(m, "%s overflow %lu\n", dir, t->overflow);
+}
 
-	if (sl->rbuff[1] == HLCAN_CFG_PACKAGE_TYPE) {
-		if (sl->rcount >= HLCAN_CFG_PACKAGE_LEN) {
-			/* will be handled by userspace tool */
-			sl->rstate = COMPLETE;
-		} else {
-			sl->rstate = RECEIVING;
-		}
-	} else if (IS_DATA_PACKAGE(sl->rbuff[1])) {
-		/* Data frame... */
-		int ext_id = IS_EXT_ID(sl->rbuff[1]) ? 4 : 2;
-		int dlc = GET_DLC(sl->rbuff[1]);
-		
-		sl->rexpected =	1 + // HLCAN_PACKET_START
-			1 + // type byte
-			ext_id +
-			dlc + 
-			1; // HLCAN_PACKET_END
-		
-		if (sl->rcount >= sl->rexpected){
-			sl->rstate = COMPLETE;
-		} else {
-			sl->rstate = RECEIVING;
+/* id_stats: one line per direction and CAN ID */
+static int hlcan_id_stats_show(struct seq_file *m, void *v)
+{
+	struct slcan *sl = m->private;
+
+	seq_puts(m, "dir       id     frames      bytes      last_ns"
+		 "    min_gap   mean_gap    max_gap dlc0..8 (gaps in us)\n");
+	hlcan_id_show_table(m, "rx", sl->rx_ids);
+	hlcan_id_show_table(m, "tx", sl->tx_ids);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hlcan_id_stats);
+
+/* id_stats.bin: struct hlcan_id_record for every entry, RX first */
+static int hlcan_id_stats_bin_show(struct seq_file *m, void *v)
+{
+	struct slcan *sl = m->private;
+	struct hlcan_id_table *tables[] = { sl->rx_ids, sl->tx_ids };
+	struct hlcan_id_record rec;
+	int i, dir;
+
+	for (dir = 0; dir < ARRAY_SIZE(tables); dir++) {
+		if (!tables[dir])
+			continue;
+		for (i = 0; i < HLCAN_ID_SLOTS; i++) {
+			if (!hlcan_id_read(&tables[dir]->slot[i], &rec))
+				continue;
+			rec.dir = dir ? HLCAN_ID_TX : HLCAN_ID_RX;
+			seq_write(m, &rec, sizeof(rec));
 		}
-	} else {
-		/* Unhandled frame type. */
-		sl->rstate = NONE;
 	}
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(hlcan_id_stats_bin);
 
-/* parse tty input stream */
-static void slcan_unesc(struct slcan *sl, unsigned char s)
+static int hlcan_id_stats_alloc(struct slcan *sl)
 {
-	if (test_and_clear_bit(SLF_ERROR, &sl->flags)) {
-		return;
+	sl->rx_ids = vzalloc(sizeof(*sl->rx_ids));
+	sl->tx_ids = vzalloc(sizeof(*sl->tx_ids));
+	if (!sl->rx_ids || !sl->tx_ids) {
+		vfree(sl->rx_ids);
+		vfree(sl->tx_ids);
+		sl->rx_ids = NULL;
+		sl->tx_ids = NULL;
+		return -ENOMEM;
 	}
 
-	if (sl->rcount > SLC_MTU) {
-		sl->dev->stats.rx_over_errors++;
-		set_bit(SLF_ERROR, &sl->flags);
-		return;
+	debugfs_create_file("id_stats", 0444, sl->debugfs, sl,
+			    &hlcan_id_stats_fops);
+	debugfs_create_file("id_stats.bin", 0444, sl->debugfs, sl,
+			    &hlcan_id_stats_bin_fops);
+	return 0;
+}
+
+/************************************************************************
+ *			LATENCY HISTOGRAMS				*
+ ************************************************************************/
+
+static void hlcan_lat_add(struct hlcan_lat *lat, int stage, u64 ns)
+{
+	struct hlcan_lat_bank *b = READ_ONCE(lat->cur);
+	int i = min_t(int, fls64(ns), HLCAN_LAT_BUCKETS - 1);
+
+	WRITE_ONCE(b->count[stage][i], b->count[stage][i] + 1);
+	if (ns > b->max_ns[stage])
+		WRITE_ONCE(b->max_ns[stage], ns);
+}
+
+/* upper bound of the bucket that holds the q/1000 quantile */
+static u64 hlcan_lat_quantile(const u64 *count, u64 total, u64 max, int q)
+{
+	u64 want = div_u64(total * q + 999, 1000), seen = 0;
+	int i;
+
+	for (i = 0; i < HLCAN_LAT_BUCKETS; i++) {
+		seen += count[i];
+		if (seen >= want)
+			return min(i ? 1ULL << i : 0ULL, max);
 	}
+	return max;
+}
 
-	sl->rbuff[sl->rcount++] = s;
+static const char * const hlcan_lat_names[HLCAN_LAT_STAGES] = {
+	[HLCAN_LAT_RX_DECODE]	= "rx_decode",
+	[HLCAN_LAT_RX_DELIVER]	= "rx_deliver",
+	[HLCAN_LAT_RX_TOTAL]	= "rx_total",
+	[HLCAN_LAT_TX_ACCEPT]	= "tx_accept",
+	[HLCAN_LAT_TX_DRAIN]	= "tx_drain",
+	[HLCAN_LAT_TX_TOTAL]	= "tx_total",
+};
 
-	/* Only check state again after we received enough data */
-	if (RECEIVING == sl->rstate
-		&& sl->rexpected > 0
-		&& sl->rcount < sl->rexpected) {
-		return;
+/* latency: percentiles per stage, then the non empty buckets */
+static int hlcan_lat_show(struct seq_file *m, void *v)
+{
+	struct slcan *sl = m->private;
+	struct hlcan_lat_bank *b = READ_ONCE(sl->lat->cur);
+	u64 count[HLCAN_LAT_BUCKETS], total[HLCAN_LAT_STAGES], max;
+	int stage, i;
+
+	seq_puts(m, "stage           count     p50_ns     p99_ns    p999_ns"
+		 "     max_ns\n");
+	for (stage = 0; stage < HLCAN_LAT_STAGES; stage++) {
+		total[stage] = 0;
+		for (i = 0; i < HLCAN_LAT_BUCKETS; i++) {
+			count[i] = READ_ONCE(b->count[stage][i]);
+			total[stage] += count[i];
+		}
+		max = READ_ONCE(b->max_ns[stage]);
+		seq_printf(m, "%-10s %10llu %10llu %10llu %10llu %10llu\n",
+			   hlcan_lat_names[stage], total[stage],
+			   hlcan_lat_quantile(count, total[stage], max, 500),
+			   hlcan_lat_quantile(count, total[stage], max, 990),
+			   hlcan_lat_quantile(count, total[stage], max, 999),
+			   max);
 	}
-	
-	hlcan_update_rstate(sl);
-	switch(sl->rstate) {
-		case COMPLETE:
-			if (IS_DATA_PACKAGE(sl->rbuff[1])) {
-				slc_bump(sl);
-			}
-			sl->rexpected = 0;
-			fallthrough;
-		case MISSED_HEADER:
-			sl->rcount = 0;
-			break;
-		default: break;
+
+	seq_puts(m, "\nbuckets (below ns:count)\n");
+	for (stage = 0; stage < HLCAN_LAT_STAGES; stage++) {
+		if (!total[stage])
+			continue;
+		seq_printf(m, "%-10s", hlcan_lat_names[stage]);
+		for (i = 0; i < HLCAN_LAT_BUCKETS; i++) {
+			u64 n = READ_ONCE(b->count[stage][i]);
+
+			if (n)
+				seq_printf(m, " %llu:%llu", 1ULL << i, n);
+		}
+		seq_putc(m, '\n');
 	}
+	return 0;
+}
+
+static int hlcan_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hlcan_lat_show, inode->i_private);
+}
+
+/* any write starts over with empty histograms */
+static ssize_t hlcan_lat_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct slcan *sl = ((struct seq_file *)file->private_data)->private;
+	struct hlcan_lat *lat = sl->lat;
+	struct hlcan_lat_bank *next;
+
+	mutex_lock(&lat->reset_lock);
+	next = lat->cur == &lat->bank[0] ? &lat->bank[1] : &lat->bank[0];
+	/* a writer that still saw next before the last switch lost a sample */
+	memset(next, 0, sizeof(*next));
+	smp_wmb();
+	WRITE_ONCE(lat->cur, next);
+	mutex_unlock(&lat->reset_lock);
+
+	return count;
+}
+
+static const struct file_operations hlcan_lat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hlcan_lat_open,
+	.read		= seq_read,
+	.write		= hlcan_lat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int hlcan_lat_alloc(struct slcan *sl)
+{
+	sl->lat = kzalloc(sizeof(*sl->lat), GFP_KERNEL);
+	if (!sl->lat)
+		return -ENOMEM;
+
+	mutex_init(&sl->lat->reset_lock);
+	sl->lat->cur = &sl->lat->bank[0];
+	debugfs_create_file("latency", 0644, sl->debugfs, sl, &hlcan_lat_fops);
+	return 0;
 }
 
 /************************************************************************
- *			STANDARD SLCAN ENCAPSULATION			*
+ *			RX CHANGE FILTER				*
  ************************************************************************/
 
-/* Encapsulate one can_frame and stuff into a TTY queue. */
-static void slc_encaps(struct slcan *sl, struct can_frame *cf)
+static void hlcan_rx_mask_lookup(struct hlcan_rx_masks *masks, u32 id, u8 *mask)
 {
-	int actual, i;
-	unsigned char *pos;
-	u32 id;
+	unsigned int i;
 
+	memset(mask, 0xff, CAN_MAX_DLEN);
+	if (!masks)
+		return;
 
-	pos = sl->xbuff;
-	*pos++ = HLCAN_PACKET_START;
-	
-	*pos = HLCAN_FRAME_PREFIX;
+	for (i = 0; i < masks->count; i++) {
+		if (masks->m[i].id == id) {
+			memcpy(mask, masks->m[i].mask, CAN_MAX_DLEN);
+			return;
+		}
+	}
+}
+
+/*
+ * True if the masked payload of the frame equals the last one passed on
+ * for its ID and the keepalive interval has not run out. Runs in the
+ * RX decoder only, so the cache has a single writer. IDs that find no
+ * slot and RTR frames always pass.
+ */
+static bool hlcan_rx_unchanged(struct slcan *sl, const struct can_frame *cf)
+{
+	u32 id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	unsigned int i, gen, h = hash_32(id, HLCAN_ID_BITS);
+	unsigned int keepalive = READ_ONCE(sl->rx_keepalive_ms);
+	struct hlcan_change_table *t;
+	struct hlcan_rx_masks *masks;
+	struct hlcan_change_entry *e;
+	u8 data[CAN_MAX_DLEN];
+	bool unchanged = false;
+	u64 now;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
-	*pos |= cf->len;
+	u8 dlc = min_t(u8, cf->len, CAN_MAX_DLEN);
 #else
-	*pos |= cf->can_dlc;
+	u8 dlc = min_t(u8, cf->can_dlc, CAN_MAX_DLEN);
 #endif
-	if (cf->can_id & CAN_RTR_FLAG) {
-		*pos |= HLCAN_FLAG_RTR;
+
+	if (cf->can_id & CAN_RTR_FLAG)
+		return false;
+
+	rcu_read_lock();
+	t = rcu_dereference(sl->rx_change);
+	if (!t)
+		goto out;
+
+	for (i = 0; i < HLCAN_ID_PROBES; i++) {
+		e = &t->slot[(h + i) & (HLCAN_ID_SLOTS - 1)];
+		if (!e->used || e->id == id)
+			break;
 	}
+	if (i == HLCAN_ID_PROBES)
+		goto out;
 
-	/* setup the frame id id */
-	/* mask the upper 3 bits because they are used for flags */
-	id = cf->can_id & 0x1FFFFFFF;
-	if (cf->can_id & CAN_EFF_FLAG) {
-		*pos++ |= HLCAN_FLAG_ID_EXT;
-		*pos++ = (unsigned char) (id & 0xFF);
-		*pos++ = (unsigned char) ((id >> 8) & 0xFF);
-		*pos++ = (unsigned char) ((id >> 16) & 0xFF);
-		*pos++ = (unsigned char) ((id >> 24) & 0xFF);
+	masks = rcu_dereference(sl->rx_masks);
+	gen = masks ? masks->gen : 0;
+	for (i = 0; i < CAN_MAX_DLEN; i++)
+		data[i] = i < dlc ? cf->data[i] : 0;
+
+	now = ktime_get_ns();
+	if (e->used && e->gen == gen) {
+		for (i = 0; i < CAN_MAX_DLEN; i++)
+			data[i] &= e->mask[i];
+		unchanged = e->dlc == dlc &&
+			!memcmp(e->data, data, CAN_MAX_DLEN) &&
+			(!keepalive ||
+			 now - e->last_ns < (u64)keepalive * NSEC_PER_MSEC);
+		if (unchanged)
+			goto out;
 	} else {
- 		++pos;
-		*pos++ = (unsigned char) (id & 0xFF);
-		*pos++ = (unsigned char) ((id >> 8) & 0xFF);
+		/* new ID or new masks */
+		e->id = id;
+		e->gen = gen;
+		e->used = true;
+		hlcan_rx_mask_lookup(masks, id, e->mask);
+		for (i = 0; i < CAN_MAX_DLEN; i++)
+			data[i] &= e->mask[i];
 	}
 
-	/* RTR frames may have a dlc > 0 but they never have any data bytes */
-	if (!(cf->can_id & CAN_RTR_FLAG)) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
-		for (i = 0; i < cf->len; i++)
-#else
-		for (i = 0; i < cf->can_dlc; i++)
-#endif
-			*pos++ = cf->data[i];
+	e->dlc = dlc;
+	memcpy(e->data, data, CAN_MAX_DLEN);
+	e->last_ns = now;
+out:
+	rcu_read_unlock();
+	return unchanged;
+}
+
+/* Switch the change filter on or off, called under rtnl */
+static int hlcan_rx_change_set(struct slcan *sl, bool on)
+{
+	struct hlcan_change_table *t = rtnl_dereference(sl->rx_change);
+
+	if (on && !t) {
+		t = vzalloc(sizeof(*t));
+		if (!t)
+			return -ENOMEM;
+		rcu_assign_pointer(sl->rx_change, t);
+	} else if (!on && t) {
+		RCU_INIT_POINTER(sl->rx_change, NULL);
+		synchronize_rcu();
+		vfree(t);
 	}
 
-	*pos++ = HLCAN_PACKET_END;
+	return 0;
+}
 
-	/* Order of next two lines is *very* important.
-	 * When we are sending a little amount of data,
-	 * the transfer may be completed inside the ops->write()
-	 * routine, because it's running with interrupts enabled.
-	 * In this case we *never* got WRITE_WAKEUP event,
-	 * if we did not request it before write operation.
-	 *       14 Oct 1994  Dmitry Gorodchanin.
-	 */
-	set_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
-	actual = sl->tty->ops->write(sl->tty, sl->xbuff, pos - sl->xbuff);
-	sl->xleft = (pos - sl->xbuff) - actual;
-	sl->xhead = sl->xbuff + actual;
+/* Add, replace or with mask NULL remove the mask of an ID, under rtnl */
+static int hlcan_rx_mask_set(struct slcan *sl, u32 id, const u8 *mask)
+{
+	struct hlcan_rx_masks *old = rtnl_dereference(sl->rx_masks);
+	struct hlcan_rx_masks *new;
+	unsigned int i, n = 0, count = old ? old->count : 0;
+
+	new = kzalloc(struct_size(new, m, count + 1), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++)
+		if (old->m[i].id != id)
+			new->m[n++] = old->m[i];
+	if (mask) {
+		if (n == HLCAN_MASKS_MAX) {
+			kfree(new);
+			return -ENOSPC;
+		}
+		new->m[n].id = id;
+		memcpy(new->m[n++].mask, mask, CAN_MAX_DLEN);
+	}
+	new->count = n;
+	new->gen = ++sl->rx_mask_gen;
+
+	rcu_assign_pointer(sl->rx_masks, new);
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+/************************************************************************
+ *			MONITOR INTERFACE				*
+ ************************************************************************/
+
+/*
+ * <dev>-mon is a receive only CAN interface that sees every frame the
+ * channel receives or sends, including the ones dropped on the way.
+ * Frames are only copied to it while it is up.
+ */
+static netdev_tx_t hlcan_mon_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	dev->stats.tx_dropped++;
+	kfree_skb(skb);
+	return NETDEV_TX_OK;
+}
+
+static const struct net_device_ops hlcan_mon_netdev_ops = {
+	.ndo_start_xmit         = hlcan_mon_xmit,
+};
+
+static void hlcan_mon_setup(struct net_device *dev)
+{
+	dev->type = ARPHRD_CAN;
+	dev->mtu = CAN_MTU;
+	dev->hard_header_len = 0;
+	dev->addr_len = 0;
+	dev->tx_queue_len = 0;
+	dev->flags = IFF_NOARP;
+	dev->netdev_ops = &hlcan_mon_netdev_ops;
+	dev->needs_free_netdev = true;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
-	sl->dev->stats.tx_bytes += cf->len;
+	can_set_ml_priv(dev, netdev_priv(dev));
 #else
-	sl->dev->stats.tx_bytes += cf->can_dlc;
+	dev->ml_priv = netdev_priv(dev);
 #endif
 }
 
-/* Write out any remaining transmit buffer. Scheduled when tty is writable */
-static void slcan_transmit(struct work_struct *work)
+/* Create <dev>-mon, called after the channel is registered */
+static void hlcan_mon_create(struct slcan *sl)
 {
-	struct slcan *sl = container_of(work, struct slcan, tx_work);
-	int actual;
+	char name[IFNAMSIZ];
+	struct net_device *mon;
+	int err;
 
-	spin_lock_bh(&sl->lock);
-	/* First make sure we're connected. */
-	if (!sl->tty || sl->magic != HLCAN_MAGIC || !netif_running(sl->dev)) {
-		spin_unlock_bh(&sl->lock);
+	if (snprintf(name, sizeof(name), "%s-mon", sl->dev->name) >= IFNAMSIZ)
+		snprintf(name, sizeof(name), "hlcan%lu-mon", sl->dev->base_addr);
+
+	mon = alloc_netdev(sizeof(struct can_ml_priv), name, NET_NAME_UNKNOWN,
+			   hlcan_mon_setup);
+	if (!mon)
+		goto err;
+
+	SET_NETDEV_DEV(mon, sl->dev->dev.parent);
+	err = register_netdev(mon);
+	if (err) {
+		free_netdev(mon);
+		goto err;
+	}
+
+	sl->mon = mon;
+	return;
+
+err:
+	netdev_warn(sl->dev, "failed to create %s\n", name);
+}
+
+/* copy of a received frame, built here as the original may never exist */
+static void hlcan_mon_rx(struct slcan *sl, const struct can_frame *cf)
+{
+	struct net_device *mon = sl->mon;
+	struct sk_buff *skb;
+
+	if (!mon || !netif_running(mon))
+		return;
+
+	skb = dev_alloc_skb(sizeof(struct can_frame) +
+			    sizeof(struct can_skb_priv));
+	if (!skb)
+		return;
+
+	skb->dev = mon;
+	skb->protocol = htons(ETH_P_CAN);
+	skb->pkt_type = PACKET_BROADCAST;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	can_skb_reserve(skb);
+	can_skb_prv(skb)->ifindex = mon->ifindex;
+	can_skb_prv(skb)->skbcnt = 0;
+
+	skb_put_data(skb, cf, sizeof(struct can_frame));
+
+	mon->stats.rx_packets++;
+	hlcan_netif_rx(skb);
+}
+
+/* copy of a frame handed to slc_xmit(), sent or not */
+static void hlcan_mon_tx(struct slcan *sl, struct sk_buff *skb)
+{
+	struct net_device *mon = sl->mon;
+
+	if (!mon || !netif_running(mon) || skb->len != CAN_MTU)
+		return;
+
+	skb = skb_clone(skb, GFP_ATOMIC);
+	if (!skb)
+		return;
+
+	skb->dev = mon;
+	skb->pkt_type = PACKET_OUTGOING;
+	mon->stats.rx_packets++;
+	netif_rx(skb);
+}
+
+/************************************************************************
+ *			BPF HOOK					*
+ ************************************************************************/
+
+/*
+ * Attach point for BPF programs on received frames, see the rx_hook
+ * module parameter. It does nothing by itself; a BPF_MODIFY_RETURN
+ * (fmod_ret) program attached to it decides what becomes of the frame:
+ * HLCAN_HOOK_PASS, a negative value to drop it, or an ifindex to send
+ * it out there instead, with HLCAN_HOOK_MIRROR to send a copy and pass
+ * the frame as well. The program sees the frame before an skb exists
+ * and can log it to a BPF ring buffer of its own. It gets the frame
+ * read-only, tracing programs cannot write to kernel memory.
+ *
+ * fmod_ret needs the function on the error injection list. ERRNO is
+ * what fail_function may inject, negative errnos which drop the frame.
+ * A BPF program may return anything, the positive range is the ifindex
+ * of a CAN interface as above.
+ */
+noinline int hlcan_rx_hook(struct net_device *dev, const struct can_frame *cf)
+{
+	int ret = HLCAN_HOOK_PASS;
+
+	/* the compiler must neither drop the call nor assume the result */
+	asm volatile("" : "+r" (ret));
+	return ret;
+}
+ALLOW_ERROR_INJECTION(hlcan_rx_hook, ERRNO);
+
+/* Send skb out on the CAN interface ifindex, consumes the skb */
+static void hlcan_rx_redirect(struct slcan *sl, struct sk_buff *skb,
+			      int ifindex)
+{
+	struct net_device *to;
+
+	rcu_read_lock();
+	to = dev_get_by_index_rcu(dev_net(sl->dev), ifindex);
+	if (!to || to == sl->dev || to->type != ARPHRD_CAN ||
+	    !netif_running(to)) {
+		rcu_read_unlock();
+		sl->rx_hook_errors++;
+		kfree_skb(skb);
 		return;
 	}
 
-	if (sl->xleft <= 0)  {
-		/* Now serial buffer is almost free & we can start
-		 * transmission of another packet */
-		sl->dev->stats.tx_packets++;
-		clear_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
-		spin_unlock_bh(&sl->lock);
-		netif_wake_queue(sl->dev);
+	skb->dev = to;
+	dev_queue_xmit(skb);
+	rcu_read_unlock();
+	sl->rx_hook_redirected++;
+}
+
+/*
+ * Throttle the serial driver as well, so the adapter's data waits in the
+ * ch341 rather than in the flip buffers. Called from the tty side only,
+ * it may sleep. Holding termios_rwsem keeps tty_unthrottle() in
+ * hlcan_rx_kick() from slipping in between the check and the throttle.
+ */
+static void hlcan_tty_throttle(struct slcan *sl, struct tty_struct *tty)
+{
+	down_read(&tty->termios_rwsem);
+	if (test_bit(SLF_THROTTLED, &sl->rx_flags) &&
+	    !test_and_set_bit(TTY_THROTTLED, &tty->flags) &&
+	    tty->ops->throttle)
+		tty->ops->throttle(tty);
+	up_read(&tty->termios_rwsem);
+}
+
+/* Send one completely decapsulated can_frame to the network layer */
+static void slc_bump(struct slcan *sl)
+{
+	struct sk_buff *skb, *clone;
+	struct can_frame cf;
+	struct hlcan_lat *lat = sl->lat;
+	u64 decoded = 0, now;
+	int verdict = HLCAN_HOOK_PASS;
+	int ext, rtr, dlc;
+	u32 id;
+
+	dlc = hlcan_parse_data_frame(sl->rx.buf, &id, &ext, &rtr, cf.data);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+	cf.len = dlc;
+#else
+	cf.can_dlc = dlc;
+#endif
+	cf.can_id = id;
+	if (rtr)
+		cf.can_id |= CAN_RTR_FLAG;
+	if (ext)
+		cf.can_id |= CAN_EFF_FLAG;
+
+	trace_hlcan_rx_frame(sl->dev->base_addr, cf.can_id, dlc,
+			     sl->rx_pos - hlcan_data_frame_len(sl->rx.buf[1]));
+
+	if (lat) {
+		decoded = ktime_get_ns();
+		hlcan_lat_add(lat, HLCAN_LAT_RX_DECODE,
+			      decoded - sl->rx_chunk_ns);
+	}
+
+	hlcan_mon_rx(sl, &cf);
+	if (sl->rx_ids)
+		hlcan_id_account(sl->rx_ids, &cf);
+
+	/* Spare the skb for a payload nobody needs to see again */
+	if (hlcan_rx_unchanged(sl, &cf)) {
+		sl->rx_suppressed++;
+		return;
+	}
+
+	if (READ_ONCE(rx_hook)) {
+		verdict = hlcan_rx_hook(sl->dev, &cf);
+		if (verdict < 0) {
+			sl->rx_hook_dropped++;
+			return;
+		}
+	}
+
+	skb = dev_alloc_skb(sizeof(struct can_frame) +
+			    sizeof(struct can_skb_priv));
+	if (!skb) {
+		sl->rx_alloc_failed++;
+		return;
+	}
+
+	skb->dev = sl->dev;
+	skb->protocol = htons(ETH_P_CAN);
+	skb->pkt_type = PACKET_BROADCAST;
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+
+	can_skb_reserve(skb);
+	can_skb_prv(skb)->ifindex = sl->dev->ifindex;
+	can_skb_prv(skb)->skbcnt = 0;
+
+	skb_put_data(skb, &cf, sizeof(struct can_frame));
+
+	if (verdict > 0) {
+		if (!(verdict & HLCAN_HOOK_MIRROR)) {
+			hlcan_rx_redirect(sl, skb, verdict);
+			return;
+		}
+		clone = skb_clone(skb, GFP_ATOMIC);
+		if (clone)
+			hlcan_rx_redirect(sl, clone,
+					  verdict & ~HLCAN_HOOK_MIRROR);
+		else
+			sl->rx_hook_errors++;
+	} else if (READ_ONCE(rx_hook)) {
+		sl->rx_hook_passed++;
+	}
+
+	if (hlcan_rx_deliver(sl, skb)) {
+		u64_stats_update_begin(&sl->rx_syncp);
+		sl->rx_packets++;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+		sl->rx_bytes += cf.len;
+#else
+		sl->rx_bytes += cf.can_dlc;
+#endif
+		u64_stats_update_end(&sl->rx_syncp);
+	}
+
+	if (lat) {
+		now = ktime_get_ns();
+		hlcan_lat_add(lat, HLCAN_LAT_RX_DELIVER, now - decoded);
+		hlcan_lat_add(lat, HLCAN_LAT_RX_TOTAL, now - sl->rx_chunk_ns);
+	}
+}
+
+/* Derive the CAN error state from the last status reply */
+static enum can_state hlcan_current_error_state(struct slcan *sl, u8 flags)
+{
+	u16 err = max(sl->bec.txerr, sl->bec.rxerr);
+
+	if (flags & HLCAN_STATUS_BUS_OFF)
+		return CAN_STATE_BUS_OFF;
+	else if (err >= 128)
+		return CAN_STATE_ERROR_PASSIVE;
+	else if (err >= 96)
+		return CAN_STATE_ERROR_WARNING;
+	else
+		return CAN_STATE_ERROR_ACTIVE;
+}
+
+/*
+ * Set new CAN error state for the device, updating statistics and
+ * populating the error frame if given.
+ */
+static void hlcan_set_error_state(struct net_device *dev,
+				  enum can_state new_state,
+				  struct can_frame *cf)
+{
+	struct slcan *sl = netdev_priv(dev);
+	u16 txerr = sl->bec.txerr;
+	u16 rxerr = sl->bec.rxerr;
+	enum can_state tx_state = txerr >= rxerr ? new_state : 0;
+	enum can_state rx_state = txerr <= rxerr ? new_state : 0;
+
+	/* bus-off is handled by hlcan_handle_status */
+	if (WARN_ON(new_state > CAN_STATE_ERROR_PASSIVE))
+		return;
+
+	can_change_state(dev, cf, tx_state, rx_state);
+
+	if (cf) {
+#ifdef CAN_ERR_CNT
+		cf->can_id |= CAN_ERR_CNT;
+#endif
+		cf->data[6] = txerr;
+		cf->data[7] = rxerr;
+	}
+}
+
+/* Update the error state from a status reply in rx.buf */
+static void hlcan_handle_status(struct slcan *sl)
+{
+	struct net_device *dev = sl->dev;
+	enum can_state new_state;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+
+	if (sl->rx.buf[HLCAN_CFG_PACKAGE_LEN - 1] != hlcan_cfg_crc(sl->rx.buf)) {
+		dev->stats.rx_errors++;
 		return;
 	}
-
-	actual = sl->tty->ops->write(sl->tty, sl->xhead, sl->xleft);
-	sl->xleft -= actual;
-	sl->xhead += actual;
-	spin_unlock_bh(&sl->lock);
+
+	sl->bec.rxerr = sl->rx.buf[HLCAN_STATUS_REC_IDX];
+	sl->bec.txerr = sl->rx.buf[HLCAN_STATUS_TEC_IDX];
+	new_state = hlcan_current_error_state(sl,
+			sl->rx.buf[HLCAN_STATUS_FLAGS_IDX]);
+
+	/* Leaving bus-off is up to hlcan_do_set_mode() */
+	if (new_state == sl->can.state || sl->can.state == CAN_STATE_BUS_OFF)
+		return;
+
+	skb = alloc_can_err_skb(dev, &cf);
+	if (!skb)
+		sl->rx_alloc_failed++;
+
+	if (new_state == CAN_STATE_BUS_OFF) {
+		sl->can.state = CAN_STATE_BUS_OFF;
+		sl->can.can_stats.bus_off++;
+		can_bus_off(dev);
+		if (skb)
+			cf->can_id |= CAN_ERR_BUSOFF;
+	} else {
+		hlcan_set_error_state(dev, new_state, skb ? cf : NULL);
+	}
+
+	if (skb && hlcan_rx_deliver(sl, skb)) {
+		u64_stats_update_begin(&sl->rx_syncp);
+		sl->rx_packets++;
+		u64_stats_update_end(&sl->rx_syncp);
+	}
+}
+
+/* count bytes the decoder throws away */
+static void hlcan_rx_discard(struct slcan *sl, int reason, int count)
+{
+	sl->rx_discarded += count;
+	trace_hlcan_rx_discard(sl->dev->base_addr, reason, count, sl->rx_pos);
+}
+
+/* parse tty input stream */
+static void slcan_unesc(struct slcan *sl, unsigned char s)
+{
+	int len;
+
+	sl->rx_pos++;
+
+	switch (hlcan_rx_byte(&sl->rx, s, &len)) {
+		case HLCAN_RX_PACKET:
+			trace_hlcan_rx_packet(sl->dev->base_addr, sl->rx.buf[1],
+					      len, sl->rx_pos - len);
+			if (IS_DATA_PACKAGE(sl->rx.buf[1])) {
+				slc_bump(sl);
+			} else {
+				sl->rx_cfg_packets++;
+				if (sl->rx.buf[2] == HLCAN_CFG_TYPE_STATUS)
+					hlcan_handle_status(sl);
+			}
+			break;
+		case HLCAN_RX_NO_HEADER:
+			hlcan_rx_discard(sl, HLCAN_DISCARD_NO_HEADER, len);
+			break;
+		case HLCAN_RX_BAD_TYPE:
+			hlcan_rx_discard(sl, HLCAN_DISCARD_BAD_TYPE, len);
+			break;
+		case HLCAN_RX_OVERRUN:
+			sl->dev->stats.rx_over_errors++;
+			hlcan_rx_discard(sl, HLCAN_DISCARD_OVERRUN, len);
+			break;
+		default: break;
+	}
+}
+
+static void hlcan_rx_resync(struct slcan *sl)
+{
+	/* Settings changed, whatever is half decoded is garbage now */
+	if (test_and_clear_bit(SLF_RESYNC, &sl->rx_flags)) {
+		int count = hlcan_rx_reset(&sl->rx);
+
+		sl->rx_resyncs++;
+		if (count)
+			hlcan_rx_discard(sl, HLCAN_DISCARD_RESYNC, count);
+	}
+}
+
+/* the tty flagged a parity, framing or overrun error */
+static void hlcan_rx_error(struct slcan *sl)
+{
+	hlcan_rx_discard(sl, HLCAN_DISCARD_TTY_ERROR, 1);
+	if (hlcan_rx_flag_error(&sl->rx))
+		sl->dev->stats.rx_errors++;
+}
+
+/************************************************************************
+ *			RX THREAD					*
+ ************************************************************************/
+
+/*
+ * With rx_thread set, slcan_receive_buf2() only copies the bytes into
+ * rx_ring and the decoding runs in a kthread of its own, which can be
+ * pinned to a CPU and given a priority through sysfs.
+ */
+static int hlcan_rx_thread_fn(void *data)
+{
+	struct slcan *sl = data;
+	struct hlcan_rx_ring *ring = sl->rx_ring;
+	unsigned int tail = ring->tail;
+
+	while (!kthread_should_stop()) {
+		struct hlcan_rx_chunk *c;
+		int i;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (tail == smp_load_acquire(&ring->head)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		c = &ring->slot[tail % HLCAN_RX_SLOTS];
+		sl->rx_chunk_ns = c->ts;
+		hlcan_rx_resync(sl);
+		for (i = 0; i < c->len; i++)
+			slcan_unesc(sl, c->data[i]);
+		if (c->err)
+			hlcan_rx_error(sl);
+
+		smp_store_release(&ring->tail, ++tail);
+		cond_resched();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/* Producer side, called from slcan_receive_buf2() under rcu_read_lock */
+static int hlcan_rx_queue(struct slcan *sl, struct task_struct *task,
+			  const unsigned char *cp, const char *fp, int count)
+{
+	struct hlcan_rx_ring *ring = sl->rx_ring;
+	unsigned int head = ring->head;
+	int done = 0;
+
+	while (done < count) {
+		struct hlcan_rx_chunk *c;
+		int len = 0;
+
+		/* The thread is behind, hold the rest back in the tty */
+		if (head - smp_load_acquire(&ring->tail) >= HLCAN_RX_SLOTS) {
+			hlcan_rx_throttle(sl);
+			break;
+		}
+
+		c = &ring->slot[head % HLCAN_RX_SLOTS];
+		c->ts = sl->lat ? ktime_get_ns() : 0;
+		c->err = 0;
+		while (done < count && len < HLCAN_RX_CHUNK) {
+			if (fp && fp[done]) {
+				c->err = 1;
+				done++;
+				break;
+			}
+			c->data[len++] = cp[done++];
+		}
+		c->len = len;
+
+		smp_store_release(&ring->head, ++head);
+	}
+
+	wake_up_process(task);
+	return done;
+}
+
+/* Apply rx_cpu and rx_sched to the RX thread, called under rtnl */
+static void hlcan_rx_thread_apply(struct slcan *sl, struct task_struct *task)
+{
+	if (sl->rx_cpu >= 0)
+		set_cpus_allowed_ptr(task, cpumask_of(sl->rx_cpu));
+	else
+		set_cpus_allowed_ptr(task, cpu_possible_mask);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+	switch (sl->rx_sched) {
+	case HLCAN_RX_SCHED_FIFO:
+		sched_set_fifo(task);
+		break;
+	case HLCAN_RX_SCHED_FIFO_LOW:
+		sched_set_fifo_low(task);
+		break;
+	default:
+		sched_set_normal(task, sl->rx_nice);
+		break;
+	}
+#else
+	{
+		struct sched_param sp = { .sched_priority = 0 };
+
+		switch (sl->rx_sched) {
+		case HLCAN_RX_SCHED_FIFO:
+			sp.sched_priority = MAX_RT_PRIO / 2;
+			sched_setscheduler_nocheck(task, SCHED_FIFO, &sp);
+			break;
+		case HLCAN_RX_SCHED_FIFO_LOW:
+			sp.sched_priority = 1;
+			sched_setscheduler_nocheck(task, SCHED_FIFO, &sp);
+			break;
+		default:
+			sched_setscheduler_nocheck(task, SCHED_NORMAL, &sp);
+			set_user_nice(task, sl->rx_nice);
+			break;
+		}
+	}
+#endif
+}
+
+static int hlcan_rx_thread_start(struct slcan *sl)
+{
+	struct task_struct *task;
+
+	sl->rx_ring = vzalloc(sizeof(*sl->rx_ring));
+	if (!sl->rx_ring)
+		return -ENOMEM;
+
+	task = kthread_create(hlcan_rx_thread_fn, sl, "%s-rx", sl->dev->name);
+	if (IS_ERR(task)) {
+		vfree(sl->rx_ring);
+		sl->rx_ring = NULL;
+		return PTR_ERR(task);
+	}
+
+	hlcan_rx_thread_apply(sl, task);
+	rcu_assign_pointer(sl->rx_task, task);
+	wake_up_process(task);
+
+	return 0;
+}
+
+static void hlcan_rx_thread_stop(struct slcan *sl)
+{
+	struct task_struct *task = rtnl_dereference(sl->rx_task);
+
+	if (!task)
+		return;
+
+	/* Make sure slcan_receive_buf2() is done with the ring */
+	RCU_INIT_POINTER(sl->rx_task, NULL);
+	synchronize_rcu();
+
+	kthread_stop(task);
+	vfree(sl->rx_ring);
+	sl->rx_ring = NULL;
+}
+
+/************************************************************************
+ *			STANDARD SLCAN ENCAPSULATION			*
+ ************************************************************************/
+
+/* Encapsulate one can_frame and stuff into a TTY queue. */
+static void slc_encaps(struct slcan *sl, struct can_frame *cf)
+{
+	int actual, len;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+	u8 dlc = cf->len;
+#else
+	u8 dlc = cf->can_dlc;
+#endif
+
+	/* mask the upper 3 bits because they are used for flags */
+	len = hlcan_data_frame(sl->xbuff, cf->can_id & CAN_EFF_MASK,
+			       cf->can_id & CAN_EFF_FLAG,
+			       cf->can_id & CAN_RTR_FLAG, dlc, cf->data);
+
+	/* Order of next two lines is *very* important.
+	 * When we are sending a little amount of data,
+	 * the transfer may be completed inside the ops->write()
+	 * routine, because it's running with interrupts enabled.
+	 * In this case we *never* got WRITE_WAKEUP event,
+	 * if we did not request it before write operation.
+	 *       14 Oct 1994  Dmitry Gorodchanin.
+	 */
+	set_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
+	actual = sl->tty->ops->write(sl->tty, sl->xbuff, len);
+	sl->xleft = len - actual;
+	sl->xhead = sl->xbuff + actual;
+	sl->tx_pos += actual;
+	if (sl->xleft > 0)
+		sl->tx_partial++;
+	if (sl->lat) {
+		sl->tx_accept_ns = ktime_get_ns();
+		hlcan_lat_add(sl->lat, HLCAN_LAT_TX_ACCEPT,
+			      sl->tx_accept_ns - sl->tx_start_ns);
+	}
+	trace_hlcan_encaps(sl->dev->base_addr, cf->can_id, dlc, len, actual,
+			   sl->tx_pos);
+	/* counted by slcan_transmit() once it is out */
+	set_bit(SLF_TX_FRAME, &sl->flags);
+	u64_stats_update_begin(&sl->tx_syncp);
+	sl->tx_bytes += dlc;
+	u64_stats_update_end(&sl->tx_syncp);
+	if (sl->tx_ids)
+		hlcan_id_account(sl->tx_ids, cf);
+}
+
+/* Write an adapter command of len bytes from xbuff. Called with sl->tx_lock held. */
+static void hlcan_write_cmd(struct slcan *sl, int len)
+{
+	int actual;
+
+	actual = sl->tty->ops->write(sl->tty, sl->xbuff, len);
+	sl->xleft = len - actual;
+	sl->xhead = sl->xbuff + actual;
+	sl->tx_pos += actual;
+	if (sl->xleft > 0) {
+		/* Hold back frames until the rest went out */
+		netif_stop_queue(sl->dev);
+		set_bit(SLF_CONFIG, &sl->flags);
+		set_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
+	}
+}
+
+/* Send a settings packet to the adapter. Called with sl->tx_lock held. */
+static int hlcan_send_config(struct slcan *sl, HLCAN_SPEED speed, int mode)
+{
+	if (!sl->tty)
+		return -ENODEV;
+
+	/* Do not cut into a frame that is still being written out */
+	if (sl->xleft > 0)
+		return -EBUSY;
+
+	hlcan_write_cmd(sl, hlcan_cfg_packet(sl->xbuff, speed, mode,
+					     sl->frame_type));
+	sl->cfg_speed = speed;
+	sl->mode = mode;
+	return 0;
+}
+
+/*
+ * Ask the adapter for its error counters, rearms itself while running.
+ * The request is not part of the vendor protocol, see status_poll_ms.
+ */
+static void hlcan_status_poll(struct work_struct *work)
+{
+	struct slcan *sl = container_of(to_delayed_work(work),
+					struct slcan, status_work);
+	unsigned int interval = READ_ONCE(status_poll_ms);
+
+	spin_lock_bh(&sl->tx_lock);
+	/* Rather skip a poll than hold back a frame or cut into one */
+	if (sl->tty && sl->xleft <= 0 && !netif_queue_stopped(sl->dev))
+		hlcan_write_cmd(sl, hlcan_status_packet(sl->xbuff));
+	spin_unlock_bh(&sl->tx_lock);
+
+	if (interval && netif_running(sl->dev))
+		schedule_delayed_work(&sl->status_work,
+				      msecs_to_jiffies(interval));
+}
+
+/* Write out any remaining transmit buffer. Scheduled when tty is writable */
+static void slcan_transmit(struct work_struct *work)
+{
+	struct slcan *sl = container_of(work, struct slcan, tx_work);
+	int actual;
+
+	spin_lock_bh(&sl->tx_lock);
+	/* First make sure we're connected. */
+	if (!sl->tty || sl->magic != HLCAN_MAGIC || !netif_running(sl->dev)) {
+		spin_unlock_bh(&sl->tx_lock);
+		return;
+	}
+
+	sl->tx_wakeups++;
+	if (sl->xleft <= 0)  {
+		/* Now serial buffer is almost free & we can start
+		 * transmission of another packet */
+		clear_bit(SLF_CONFIG, &sl->flags);
+		if (test_and_clear_bit(SLF_TX_FRAME, &sl->flags)) {
+			u64_stats_update_begin(&sl->tx_syncp);
+			sl->tx_packets++;
+			u64_stats_update_end(&sl->tx_syncp);
+			if (sl->lat) {
+				u64 now = ktime_get_ns();
+
+				hlcan_lat_add(sl->lat, HLCAN_LAT_TX_DRAIN,
+					      now - sl->tx_accept_ns);
+				hlcan_lat_add(sl->lat, HLCAN_LAT_TX_TOTAL,
+					      now - sl->tx_start_ns);
+			}
+		}
+		clear_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
+		spin_unlock_bh(&sl->tx_lock);
+		netif_wake_queue(sl->dev);
+		return;
+	}
+
+	actual = sl->tty->ops->write(sl->tty, sl->xhead, sl->xleft);
+	sl->xleft -= actual;
+	sl->xhead += actual;
+	sl->tx_pos += actual;
+	trace_hlcan_tx_drain(sl->dev->base_addr, actual, sl->xleft, sl->tx_pos);
+	spin_unlock_bh(&sl->tx_lock);
+}
+
+/*
+ * Called by the driver when there's room for more data.
+ * Schedule the transmit.
+ */
+static void slcan_write_wakeup(struct tty_struct *tty)
+{
+	struct slcan *sl;
+
+	rcu_read_lock();
+	sl = rcu_dereference(tty->disc_data);
+	if (sl)
+		schedule_work(&sl->tx_work);
+	rcu_read_unlock();
+}
+
+/* Send a can_frame to a TTY queue. */
+static netdev_tx_t slc_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct slcan *sl = netdev_priv(dev);
+	struct can_frame *cf;
+
+	if (skb->len != CAN_MTU)
+		goto out;
+
+	spin_lock(&sl->tx_lock);
+	if (sl->lat)
+		sl->tx_start_ns = ktime_get_ns();
+	if (!netif_running(dev))  {
+		spin_unlock(&sl->tx_lock);
+		printk(KERN_WARNING "%s: xmit: iface is down\n", dev->name);
+		goto out;
+	}
+	if (sl->tty == NULL) {
+		spin_unlock(&sl->tx_lock);
+		goto out;
+	}
+	if (sl->xleft > 0) {
+		/* An adapter command is still being written out */
+		netif_stop_queue(sl->dev);
+		spin_unlock(&sl->tx_lock);
+		return NETDEV_TX_BUSY;
+	}
+
+	netif_stop_queue(sl->dev);
+	cf = (struct can_frame *) skb->data;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,12,0)
+	trace_hlcan_xmit(dev->base_addr, cf->can_id, cf->len, sl->tx_pos);
+#else
+	trace_hlcan_xmit(dev->base_addr, cf->can_id, cf->can_dlc, sl->tx_pos);
+#endif
+	slc_encaps(sl, cf); /* encaps & send */
+	spin_unlock(&sl->tx_lock);
+
+out:
+	hlcan_mon_tx(sl, skb);
+	kfree_skb(skb);
+	return NETDEV_TX_OK;
+}
+
+
+/******************************************
+ *   Adapter settings.
+ ******************************************/
+
+/* Find the adapter speed closest to a bitrate */
+static HLCAN_SPEED hlcan_bitrate_to_speed(u32 bitrate, u32 *actual)
+{
+	int i, best = 0;
+
+	for (i = 1; i < ARRAY_SIZE(hlcan_speeds); i++) {
+		if (abs((s64)hlcan_speeds[i].bitrate - bitrate) <
+		    abs((s64)hlcan_speeds[best].bitrate - bitrate))
+			best = i;
+	}
+
+	*actual = hlcan_speeds[best].bitrate;
+	return hlcan_speeds[best].speed;
+}
+
+static u32 hlcan_speed_to_bitrate(HLCAN_SPEED speed)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hlcan_speeds); i++) {
+		if (hlcan_speeds[i].speed == speed)
+			return hlcan_speeds[i].bitrate;
+	}
+
+	return 0;
+}
+
+static int hlcan_ctrlmode_to_mode(u32 ctrlmode)
+{
+	int mode = HLCAN_MODE_NORMAL;
+
+	if (ctrlmode & CAN_CTRLMODE_LOOPBACK)
+		mode |= HLCAN_MODE_LOOPBACK;
+	if (ctrlmode & CAN_CTRLMODE_LISTENONLY)
+		mode |= HLCAN_MODE_SILENT;
+
+	return mode;
+}
+
+/*
+ * Reflect an adapter mode that was set from userspace in the netdev.
+ * Netlink and dev_change_flags() write the same fields, so under RTNL.
+ */
+static void hlcan_apply_mode(struct slcan *sl, int mode)
+{
+	ASSERT_RTNL();
+
+	sl->mode = mode;
+
+	sl->can.ctrlmode &= ~(CAN_CTRLMODE_LOOPBACK | CAN_CTRLMODE_LISTENONLY);
+	if (mode & HLCAN_MODE_LOOPBACK) {
+		sl->can.ctrlmode |= CAN_CTRLMODE_LOOPBACK;
+		/* adapter sends our frames back */
+		sl->dev->flags |= IFF_ECHO;
+	} else {
+		sl->dev->flags &= ~IFF_ECHO;
+	}
+	if (mode & HLCAN_MODE_SILENT)
+		sl->can.ctrlmode |= CAN_CTRLMODE_LISTENONLY;
+}
+
+/*
+ * Called by the CAN netlink code with the new bit timing. Both the
+ * bit timing and the control mode of the same netlink request are in
+ * place at this point, so the adapter gets a single settings packet.
+ */
+static int hlcan_set_bittiming(struct net_device *dev)
+{
+	struct slcan *sl = netdev_priv(dev);
+	struct can_bittiming *bt = &sl->can.bittiming;
+	u32 bitrate;
+	int ret;
+
+	sl->speed = hlcan_bitrate_to_speed(bt->bitrate, &bitrate);
+	if (bitrate != bt->bitrate)
+		netdev_info(dev, "bitrate %u not supported, using %u\n",
+			    bt->bitrate, bitrate);
+	bt->bitrate = bitrate;
+
+	spin_lock_bh(&sl->tx_lock);
+	ret = hlcan_send_config(sl, sl->speed,
+				hlcan_ctrlmode_to_mode(sl->can.ctrlmode));
+	spin_unlock_bh(&sl->tx_lock);
+
+	/* no tty yet, slc_open() will send the settings */
+	return ret == -ENODEV ? 0 : ret;
+}
+
+/*
+ * Change the settings of a running channel in place. TX is paused until
+ * the frame in flight is out, the adapter gets the new settings and the
+ * RX decoder starts over. The netdev stays registered, so its ifindex
+ * and the sockets bound to it are kept. Called under RTNL.
+ */
+static int hlcan_reconfigure(struct slcan *sl, HLCAN_SPEED speed, int mode,
+			     HLCAN_FRAME_TYPE frame)
+{
+	unsigned long timeout;
+	ktime_t start;
+	int ret;
+
+	start = ktime_get();
+	timeout = jiffies + msecs_to_jiffies(HLCAN_RECONFIG_TIMEOUT_MS);
+	netif_stop_queue(sl->dev);
+
+	for (;;) {
+		spin_lock_bh(&sl->tx_lock);
+		if (sl->xleft <= 0)
+			break;
+		spin_unlock_bh(&sl->tx_lock);
+
+		if (time_after(jiffies, timeout)) {
+			ret = -ETIMEDOUT;
+			goto out_wake;
+		}
+		usleep_range(100, 200);
+	}
+
+	sl->frame_type = frame;
+	ret = hlcan_send_config(sl, speed, mode);
+	spin_unlock_bh(&sl->tx_lock);
+	if (ret)
+		goto out_wake;
+
+	sl->speed = speed;
+	sl->can.bittiming.bitrate = hlcan_speed_to_bitrate(speed);
+	hlcan_apply_mode(sl, mode);
+	set_bit(SLF_RESYNC, &sl->rx_flags);
+
+	netdev_info(sl->dev, "reconfigured in %lld us\n",
+		    ktime_us_delta(ktime_get(), start));
+
+out_wake:
+	/* with part of the settings still queued slcan_transmit() wakes us */
+	if (netif_running(sl->dev) && !test_bit(SLF_CONFIG, &sl->flags))
+		netif_wake_queue(sl->dev);
+	return ret;
+}
+
+/******************************************
+ *   Routines looking at netdevice side.
+ ******************************************/
+
+/* Netdevice UP -> DOWN routine */
+static int slc_close(struct net_device *dev)
+{
+	struct slcan *sl = netdev_priv(dev);
+
+	cancel_delayed_work_sync(&sl->status_work);
+	hlcan_rx_thread_stop(sl);
+
+	spin_lock_bh(&sl->tx_lock);
+	if (sl->tty) {
+		/* TTY discipline is running. */
+		clear_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
+	}
+	netif_stop_queue(dev);
+	sl->xleft    = 0;
+	spin_unlock_bh(&sl->tx_lock);
+
+	/* The RX side drops its partial frame by itself */
+	set_bit(SLF_RESYNC, &sl->rx_flags);
+
+	sl->can.state = CAN_STATE_STOPPED;
+	close_candev(dev);
+
+	return 0;
+}
+
+/* Netdevice DOWN -> UP routine */
+static int slc_open(struct net_device *dev)
+{
+	int ret, mode;
+	struct slcan *sl = netdev_priv(dev);
+
+	if (sl->tty == NULL)
+		return -ENODEV;
+
+	/* Common open */
+	ret = open_candev(dev);
+	if (ret) {
+		return ret;
+	}
+
+	if (sl->rx_thread) {
+		ret = hlcan_rx_thread_start(sl);
+		if (ret) {
+			close_candev(dev);
+			return ret;
+		}
+	}
+
+	sl->flags &= (1 << SLF_INUSE);
+	/* A throttled tty is released by hlcan_rx_kick() */
+	/* Nothing half decoded or flagged from before counts any more */
+	set_bit(SLF_RESYNC, &sl->rx_flags);
+	sl->can.state = CAN_STATE_ERROR_ACTIVE;
+	netif_start_queue(dev);
+
+	/* Bring the adapter in line with what was set via netlink */
+	mode = hlcan_ctrlmode_to_mode(sl->can.ctrlmode);
+	if (sl->speed != sl->cfg_speed || mode != sl->mode) {
+		spin_lock_bh(&sl->tx_lock);
+		ret = hlcan_send_config(sl, sl->speed, mode);
+		spin_unlock_bh(&sl->tx_lock);
+		if (ret)
+			netdev_warn(dev, "failed to configure adapter: %d\n", ret);
+	}
+
+	sl->bec.txerr = 0;
+	sl->bec.rxerr = 0;
+	if (status_poll_ms)
+		schedule_delayed_work(&sl->status_work,
+				      msecs_to_jiffies(status_poll_ms));
+
+	return 0;
+}
+
+/* Packet counters live with the RX and TX state, errors in dev->stats */
+static void slc_get_stats64(struct net_device *dev,
+			    struct rtnl_link_stats64 *stats)
+{
+	struct slcan *sl = netdev_priv(dev);
+	unsigned int start;
+
+	netdev_stats_to_stats64(stats, &dev->stats);
+
+	do {
+		start = u64_stats_fetch_begin(&sl->rx_syncp);
+		stats->rx_packets = sl->rx_packets;
+		stats->rx_bytes = sl->rx_bytes;
+	} while (u64_stats_fetch_retry(&sl->rx_syncp, start));
+
+	do {
+		start = u64_stats_fetch_begin(&sl->tx_syncp);
+		stats->tx_packets = sl->tx_packets;
+		stats->tx_bytes = sl->tx_bytes;
+	} while (u64_stats_fetch_retry(&sl->tx_syncp, start));
+}
+
+static const struct net_device_ops slc_netdev_ops = {
+	.ndo_open               = slc_open,
+	.ndo_stop               = slc_close,
+	.ndo_start_xmit         = slc_xmit,
+	.ndo_get_stats64        = slc_get_stats64,
+	.ndo_change_mtu         = can_change_mtu,
+};
+
+/*
+ * ethtool -i shows the tty and the adapter settings, ethtool -S the
+ * counters that do not fit into the generic netdev statistics.
+ */
+static const char * const hlcan_mode_names[] = {
+	[HLCAN_MODE_NORMAL]		= "normal",
+	[HLCAN_MODE_LOOPBACK]		= "loopback",
+	[HLCAN_MODE_SILENT]		= "silent",
+	[HLCAN_MODE_LOOPBACK_SILENT]	= "loopback-silent",
+};
+
+static void hlcan_get_drvinfo(struct net_device *dev,
+			      struct ethtool_drvinfo *info)
+{
+	struct slcan *sl = netdev_priv(dev);
+	u32 bitrate = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hlcan_speeds); i++)
+		if (hlcan_speeds[i].speed == sl->cfg_speed)
+			bitrate = hlcan_speeds[i].bitrate;
+
+	strscpy(info->driver, DRV_NAME, sizeof(info->driver));
+	snprintf(info->fw_version, sizeof(info->fw_version), "%u %s",
+		 bitrate, sl->mode < ARRAY_SIZE(hlcan_mode_names) ?
+		 hlcan_mode_names[sl->mode] : "unknown");
+
+	spin_lock_bh(&sl->tx_lock);
+	if (sl->tty)
+		strscpy(info->bus_info, sl->tty->name, sizeof(info->bus_info));
+	spin_unlock_bh(&sl->tx_lock);
+}
+
+static const char hlcan_stat_names[][ETH_GSTRING_LEN] = {
+	"rx_resyncs",
+	"rx_discarded_bytes",
+	"rx_cfg_packets",
+	"rx_alloc_failed",
+	"rx_suppressed",
+	"rx_hook_passed",
+	"rx_hook_dropped",
+	"rx_hook_redirected",
+	"rx_hook_errors",
+	"rx_throttled",
+	"rx_throttled_us",
+	"rx_backlog_hwm",
+	"rx_ring_used",
+	"tx_partial_writes",
+	"tx_wakeups",
+	"tx_pending_bytes",
+};
+
+static int hlcan_get_sset_count(struct net_device *dev, int sset)
+{
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+	return ARRAY_SIZE(hlcan_stat_names);
+}
+
+static void hlcan_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, hlcan_stat_names, sizeof(hlcan_stat_names));
+}
+
+/* Called under rtnl, so rx_ring stays as it is */
+static void hlcan_get_ethtool_stats(struct net_device *dev,
+				    struct ethtool_stats *stats, u64 *data)
+{
+	struct slcan *sl = netdev_priv(dev);
+	struct hlcan_rx_ring *ring = sl->rx_ring;
+	int i = 0;
+
+	data[i++] = READ_ONCE(sl->rx_resyncs);
+	data[i++] = READ_ONCE(sl->rx_discarded);
+	data[i++] = READ_ONCE(sl->rx_cfg_packets);
+	data[i++] = READ_ONCE(sl->rx_alloc_failed);
+	data[i++] = READ_ONCE(sl->rx_suppressed);
+	data[i++] = READ_ONCE(sl->rx_hook_passed);
+	data[i++] = READ_ONCE(sl->rx_hook_dropped);
+	data[i++] = READ_ONCE(sl->rx_hook_redirected);
+	data[i++] = READ_ONCE(sl->rx_hook_errors);
+	data[i++] = READ_ONCE(sl->rx_throttled);
+	data[i++] = READ_ONCE(sl->rx_throttled_us);
+	data[i++] = READ_ONCE(sl->rx_backlog_hwm);
+	data[i++] = ring ? READ_ONCE(ring->head) - READ_ONCE(ring->tail) : 0;
+
+	spin_lock_bh(&sl->tx_lock);
+	data[i++] = sl->tx_partial;
+	data[i++] = sl->tx_wakeups;
+	data[i++] = max(sl->xleft, 0);
+	spin_unlock_bh(&sl->tx_lock);
+}
+
+static const struct ethtool_ops hlcan_ethtool_ops = {
+	.get_drvinfo		= hlcan_get_drvinfo,
+	.get_sset_count		= hlcan_get_sset_count,
+	.get_strings		= hlcan_get_strings,
+	.get_ethtool_stats	= hlcan_get_ethtool_stats,
+};
+
+/*
+ * Per channel RX backpressure figures in /sys/class/net/<dev>/hlcan/.
+ * Writing anything to rx_backlog_hwm starts a new measurement.
+ */
+static ssize_t rx_backlog_hwm_show(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%u\n", sl->rx_backlog_hwm);
+}
+
+static ssize_t rx_backlog_hwm_store(struct device *d,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	sl->rx_backlog_hwm = 0;
+	return count;
+}
+static DEVICE_ATTR_RW(rx_backlog_hwm);
+
+static ssize_t rx_throttled_show(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%lu\n", sl->rx_throttled);
+}
+static DEVICE_ATTR_RO(rx_throttled);
+
+static ssize_t rx_throttled_us_show(struct device *d,
+				    struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%llu\n", sl->rx_throttled_us);
+}
+static DEVICE_ATTR_RO(rx_throttled_us);
+
+/*
+ * rx_thread can only be switched while the interface is down. rx_cpu,
+ * rx_sched and rx_nice take effect on a running thread right away.
+ */
+static ssize_t rx_thread_show(struct device *d,
+			      struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%d\n", sl->rx_thread);
+}
+
+static ssize_t rx_thread_store(struct device *d,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct net_device *dev = to_net_dev(d);
+	struct slcan *sl = netdev_priv(dev);
+	bool on;
+	int err;
+
+	err = kstrtobool(buf, &on);
+	if (err)
+		return err;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	if (netif_running(dev))
+		err = -EBUSY;
+	else
+		sl->rx_thread = on;
+	rtnl_unlock();
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(rx_thread);
+
+static ssize_t rx_cpu_show(struct device *d,
+			   struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%d\n", sl->rx_cpu);
+}
+
+static ssize_t rx_cpu_store(struct device *d,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	struct task_struct *task;
+	int err, cpu;
+
+	err = kstrtoint(buf, 0, &cpu);
+	if (err)
+		return err;
+	if (cpu < -1 || cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_possible(cpu)))
+		return -EINVAL;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	sl->rx_cpu = cpu;
+	task = rtnl_dereference(sl->rx_task);
+	if (task)
+		hlcan_rx_thread_apply(sl, task);
+	rtnl_unlock();
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_cpu);
+
+static const char * const hlcan_rx_sched_names[] = {
+	[HLCAN_RX_SCHED_NORMAL]		= "normal",
+	[HLCAN_RX_SCHED_FIFO_LOW]	= "fifo_low",
+	[HLCAN_RX_SCHED_FIFO]		= "fifo",
+};
+
+static ssize_t rx_sched_show(struct device *d,
+			     struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%s\n", hlcan_rx_sched_names[sl->rx_sched]);
+}
+
+static ssize_t rx_sched_store(struct device *d,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	struct task_struct *task;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hlcan_rx_sched_names); i++)
+		if (sysfs_streq(buf, hlcan_rx_sched_names[i]))
+			break;
+	if (i == ARRAY_SIZE(hlcan_rx_sched_names))
+		return -EINVAL;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	sl->rx_sched = i;
+	task = rtnl_dereference(sl->rx_task);
+	if (task)
+		hlcan_rx_thread_apply(sl, task);
+	rtnl_unlock();
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_sched);
+
+static ssize_t rx_nice_show(struct device *d,
+			    struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%d\n", sl->rx_nice);
+}
+
+static ssize_t rx_nice_store(struct device *d,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	struct task_struct *task;
+	int err, nice;
+
+	err = kstrtoint(buf, 0, &nice);
+	if (err)
+		return err;
+	if (nice < MIN_NICE || nice > MAX_NICE)
+		return -EINVAL;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	sl->rx_nice = nice;
+	task = rtnl_dereference(sl->rx_task);
+	if (task)
+		hlcan_rx_thread_apply(sl, task);
+	rtnl_unlock();
+
+	return count;
+}
+static DEVICE_ATTR_RW(rx_nice);
+
+/*
+ * Change filter: rx_change_filter switches it, rx_change_keepalive_ms
+ * lets an unchanged frame through after that long. rx_change_mask takes
+ * "<id> <mask>" with the mask as up to 16 hex digits, one byte per data
+ * byte and set bits compared, or "<id>" alone to drop the mask. IDs
+ * written with 8 digits are extended ones, like cansend has them.
+ */
+static ssize_t rx_change_filter_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%d\n", !!rcu_access_pointer(sl->rx_change));
+}
+
+static ssize_t rx_change_filter_store(struct device *d,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	bool on;
+	int err;
+
+	err = kstrtobool(buf, &on);
+	if (err)
+		return err;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	err = hlcan_rx_change_set(sl, on);
+	rtnl_unlock();
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(rx_change_filter);
+
+static ssize_t rx_change_keepalive_ms_show(struct device *d,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%u\n", sl->rx_keepalive_ms);
+}
+
+static ssize_t rx_change_keepalive_ms_store(struct device *d,
+					    struct device_attribute *attr,
+					    const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	unsigned int ms;
+	int err;
+
+	err = kstrtouint(buf, 0, &ms);
+	if (err)
+		return err;
+
+	WRITE_ONCE(sl->rx_keepalive_ms, ms);
+	return count;
+}
+static DEVICE_ATTR_RW(rx_change_keepalive_ms);
+
+static ssize_t rx_change_mask_show(struct device *d,
+				   struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	struct hlcan_rx_masks *masks;
+	unsigned int i;
+	int len = 0;
+
+	rcu_read_lock();
+	masks = rcu_dereference(sl->rx_masks);
+	for (i = 0; masks && i < masks->count; i++) {
+		u32 id = masks->m[i].id;
+
+		if (id & CAN_EFF_FLAG)
+			len += sprintf(buf + len, "%08x %*phN\n",
+				       id & CAN_EFF_MASK, CAN_MAX_DLEN,
+				       masks->m[i].mask);
+		else
+			len += sprintf(buf + len, "%03x %*phN\n",
+				       id, CAN_MAX_DLEN, masks->m[i].mask);
+	}
+	rcu_read_unlock();
+
+	return len;
+}
+
+static ssize_t rx_change_mask_store(struct device *d,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+	char idstr[9], maskstr[17];
+	u8 mask[CAN_MAX_DLEN];
+	int n, err, len;
+	u32 id;
+
+	n = sscanf(buf, "%8s %16s", idstr, maskstr);
+	if (n < 1)
+		return -EINVAL;
+
+	err = kstrtou32(idstr, 16, &id);
+	if (err)
+		return err;
+	if (strlen(idstr) == 8) {
+		if (id > CAN_EFF_MASK)
+			return -EINVAL;
+		id |= CAN_EFF_FLAG;
+	} else if (id > CAN_SFF_MASK) {
+		return -EINVAL;
+	}
+
+	if (n == 2) {
+		/* short masks leave the remaining bytes uncompared */
+		memset(mask, 0, sizeof(mask));
+		len = strlen(maskstr);
+		if (len % 2 || hex2bin(mask, maskstr, len / 2))
+			return -EINVAL;
+	}
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	err = hlcan_rx_mask_set(sl, id, n == 2 ? mask : NULL);
+	rtnl_unlock();
+
+	return err ? err : count;
+}
+static DEVICE_ATTR_RW(rx_change_mask);
+
+static ssize_t rx_suppressed_show(struct device *d,
+				  struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%lu\n", sl->rx_suppressed);
+}
+static DEVICE_ATTR_RO(rx_suppressed);
+
+/* what became of the frames that went through hlcan_rx_hook() */
+static ssize_t rx_hook_show(struct device *d,
+			    struct device_attribute *attr, char *buf)
+{
+	struct slcan *sl = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "passed %lu dropped %lu redirected %lu errors %lu\n",
+		       sl->rx_hook_passed, sl->rx_hook_dropped,
+		       sl->rx_hook_redirected, sl->rx_hook_errors);
+}
+static DEVICE_ATTR_RO(rx_hook);
+
+static struct attribute *hlcan_attrs[] = {
+	&dev_attr_rx_backlog_hwm.attr,
+	&dev_attr_rx_throttled.attr,
+	&dev_attr_rx_throttled_us.attr,
+	&dev_attr_rx_thread.attr,
+	&dev_attr_rx_cpu.attr,
+	&dev_attr_rx_sched.attr,
+	&dev_attr_rx_nice.attr,
+	&dev_attr_rx_change_filter.attr,
+	&dev_attr_rx_change_keepalive_ms.attr,
+	&dev_attr_rx_change_mask.attr,
+	&dev_attr_rx_suppressed.attr,
+	&dev_attr_rx_hook.attr,
+	NULL
+};
+
+static const struct attribute_group hlcan_attr_group = {
+	.name = "hlcan",
+	.attrs = hlcan_attrs,
+};
+
+
+/******************************************
+  Routines looking at TTY side.
+ ******************************************/
+
+/************************************************************************
+ *			RAW PASSTHROUGH					*
+ ************************************************************************/
+
+/*
+ * Copy a chunk of received bytes into the raw ring. Runs on the tty side
+ * only and never waits for the reader: if the chunk does not fit, it is
+ * dropped and counted.
+ */
+static void hlcan_raw_capture(struct hlcan_raw *raw, const unsigned char *cp,
+			      const char *fp, int count)
+{
+	struct hlcan_raw_ring *r = raw->ring;
+	unsigned char *data = (unsigned char *)r + HLCAN_RAW_HDR_SIZE;
+	u32 head = r->head, tail = READ_ONCE(r->tail);
+	u32 need = ALIGN(sizeof(struct hlcan_raw_record) + count,
+			 HLCAN_RAW_ALIGN);
+	u32 off = head & (HLCAN_RAW_DATA_SIZE - 1);
+	u32 pad = HLCAN_RAW_DATA_SIZE - off < need ?
+		HLCAN_RAW_DATA_SIZE - off : 0;
+	struct hlcan_raw_record *rec;
+	int i;
+
+	/* the reader owns tail, do not trust it beyond head */
+	if (head - tail > HLCAN_RAW_DATA_SIZE)
+		tail = head;
+
+	if (head + pad + need - tail > HLCAN_RAW_DATA_SIZE) {
+		r->lost_chunks++;
+		r->lost_bytes += count;
+		return;
+	}
+
+	if (pad) {
+		rec = (struct hlcan_raw_record *)(data + off);
+		rec->ts_ns = 0;
+		rec->len = 0;
+		rec->flags = 0;
+		head += pad;
+		off = 0;
+	}
+
+	rec = (struct hlcan_raw_record *)(data + off);
+	rec->ts_ns = ktime_get_ns();
+	rec->len = count;
+	rec->flags = 0;
+	for (i = 0; fp && i < count; i++) {
+		if (fp[i]) {
+			rec->flags |= HLCAN_RAW_ERROR;
+			break;
+		}
+	}
+	memcpy(rec + 1, cp, count);
+
+	smp_store_release(&r->head, head + need);
+	if (wq_has_sleeper(&raw->wait))
+		wake_up_interruptible(&raw->wait);
+}
+
+static void hlcan_raw_release(struct kref *ref)
+{
+	struct hlcan_raw *raw = container_of(ref, struct hlcan_raw, ref);
+
+	vfree(raw->ring);
+	kfree(raw);
+}
+
+static int hlcan_raw_open(struct inode *inode, struct file *file)
+{
+	struct hlcan_raw *raw = container_of(file->private_data,
+					     struct hlcan_raw, misc);
+
+	/* misc_open() holds misc_mtx, so raw cannot go away here */
+	kref_get(&raw->ref);
+	file->private_data = raw;
+	return 0;
+}
+
+static int hlcan_raw_file_release(struct inode *inode, struct file *file)
+{
+	struct hlcan_raw *raw = file->private_data;
+
+	kref_put(&raw->ref, hlcan_raw_release);
+	return 0;
+}
+
+static int hlcan_raw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct hlcan_raw *raw = file->private_data;
+
+	return remap_vmalloc_range(vma, raw->ring, vma->vm_pgoff);
+}
+
+static __poll_t hlcan_raw_poll(struct file *file, poll_table *wait)
+{
+	struct hlcan_raw *raw = file->private_data;
+	struct hlcan_raw_ring *r = raw->ring;
+	__poll_t mask = 0;
+
+	poll_wait(file, &raw->wait, wait);
+	if (smp_load_acquire(&r->head) != READ_ONCE(r->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	/* detached, nothing more comes in and writes fail */
+	if (!READ_ONCE(raw->sl))
+		mask |= EPOLLHUP | EPOLLERR;
+	return mask;
+}
+
+/* length of the adapter packet at buf, 0 if incomplete, <0 if invalid */
+static int hlcan_raw_packet_len(const unsigned char *buf, size_t len)
+{
+	int n;
+
+	switch (hlcan_rx_state(buf, min_t(size_t, len, PAGE_SIZE), &n)) {
+	case MISSED_HEADER:
+	case NONE:
+		return -EINVAL;
+	default:
+		return n;
+	}
 }
 
 /*
- * Called by the driver when there's room for more data.
- * Schedule the transmit.
+ * Send pre-encoded adapter packets as they are. Only whole packets that
+ * fit into the tty right away are taken, so they never interleave with
+ * frames from the network side. Returns how many bytes were sent, 0 if
+ * the first packet has to wait for room, -EINVAL if it is not a whole
+ * packet, which waiting would not change.
  */
-static void slcan_write_wakeup(struct tty_struct *tty)
+static ssize_t hlcan_raw_send(struct hlcan_raw *raw, const unsigned char *buf,
+			      size_t len)
 {
-	struct slcan *sl = tty->disc_data;
+	struct slcan *sl;
+	ssize_t done = 0;
+	unsigned int room;
+	int n;
+
+	n = hlcan_raw_packet_len(buf, len);
+	if (n < 0)
+		return n;
+	if (n == 0 || n > len)
+		return -EINVAL;
+
+	mutex_lock(&raw->lock);
+	sl = raw->sl;
+	if (!sl) {
+		mutex_unlock(&raw->lock);
+		return -ENODEV;
+	}
+
+	spin_lock_bh(&sl->tx_lock);
+	if (!sl->tty || sl->xleft > 0)
+		goto out;
+
+	room = tty_write_room(sl->tty);
+	while (done < (ssize_t)len) {
+		n = hlcan_raw_packet_len(buf + done, len - done);
+		/* the rest is for the next write */
+		if (n <= 0 || n > len - done || done + n > room)
+			break;
+		done += n;
+	}
+	if (done > 0)
+		sl->tty->ops->write(sl->tty, buf, done);
+out:
+	spin_unlock_bh(&sl->tx_lock);
+	mutex_unlock(&raw->lock);
 
-	schedule_work(&sl->tx_work);
+	return done;
 }
 
-/* Send a can_frame to a TTY queue. */
-static netdev_tx_t slc_xmit(struct sk_buff *skb, struct net_device *dev)
+static ssize_t hlcan_raw_write(struct file *file, const char __user *ubuf,
+			       size_t len, loff_t *ppos)
 {
-	struct slcan *sl = netdev_priv(dev);
+	struct hlcan_raw *raw = file->private_data;
+	unsigned char *buf;
+	ssize_t ret;
 
-	if (skb->len != CAN_MTU)
-		goto out;
+	if (!len)
+		return 0;
 
-	spin_lock(&sl->lock);
-	if (!netif_running(dev))  {
-		spin_unlock(&sl->lock);
-		printk(KERN_WARNING "%s: xmit: iface is down\n", dev->name);
-		goto out;
-	}
-	if (sl->tty == NULL) {
-		spin_unlock(&sl->lock);
-		goto out;
-	}
+	len = min_t(size_t, len, PAGE_SIZE);
+	buf = memdup_user(ubuf, len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
 
-	netif_stop_queue(sl->dev);
-	slc_encaps(sl, (struct can_frame *) skb->data); /* encaps & send */
-	spin_unlock(&sl->lock);
+	/*
+	 * 0 means a whole packet waits for xleft or tty room. There is no
+	 * wakeup for that, so poll for it.
+	 */
+	while ((ret = hlcan_raw_send(raw, buf, len)) == 0) {
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		schedule_timeout_interruptible(1);
+	}
 
-out:
-	kfree_skb(skb);
-	return NETDEV_TX_OK;
+	kfree(buf);
+	return ret;
 }
 
+static const struct file_operations hlcan_raw_fops = {
+	.owner		= THIS_MODULE,
+	.open		= hlcan_raw_open,
+	.release	= hlcan_raw_file_release,
+	.mmap		= hlcan_raw_mmap,
+	.poll		= hlcan_raw_poll,
+	.write		= hlcan_raw_write,
+	.llseek		= noop_llseek,
+};
 
-/******************************************
- *   Routines looking at netdevice side.
- ******************************************/
+/* Create /dev/hlcan/<tty>, called after the channel is registered */
+static void hlcan_raw_create(struct slcan *sl, struct tty_struct *tty)
+{
+	struct hlcan_raw *raw;
+	int err = -ENOMEM;
+
+	raw = kzalloc(sizeof(*raw), GFP_KERNEL);
+	if (!raw)
+		goto err;
+
+	raw->ring = vmalloc_user(HLCAN_RAW_HDR_SIZE + HLCAN_RAW_DATA_SIZE);
+	if (!raw->ring)
+		goto err_free;
+	raw->ring->size = HLCAN_RAW_DATA_SIZE;
+	raw->ring->data_offset = HLCAN_RAW_HDR_SIZE;
+
+	kref_init(&raw->ref);
+	mutex_init(&raw->lock);
+	init_waitqueue_head(&raw->wait);
+	raw->sl = sl;
+
+	snprintf(raw->name, sizeof(raw->name), "hlcan-%s", tty->name);
+	snprintf(raw->nodename, sizeof(raw->nodename), "hlcan/%s", tty->name);
+	raw->misc.minor = MISC_DYNAMIC_MINOR;
+	raw->misc.name = raw->name;
+	raw->misc.nodename = raw->nodename;
+	raw->misc.fops = &hlcan_raw_fops;
+
+	err = misc_register(&raw->misc);
+	if (err)
+		goto err_free;
+
+	sl->raw = raw;
+	return;
+
+err_free:
+	vfree(raw->ring);
+	kfree(raw);
+err:
+	netdev_warn(sl->dev, "failed to create raw device: %d\n", err);
+}
 
-/* Netdevice UP -> DOWN routine */
-static int slc_close(struct net_device *dev)
+/* Detach the raw device, open files keep it until they are closed */
+static void hlcan_raw_destroy(struct slcan *sl)
 {
-	struct slcan *sl = netdev_priv(dev);
+	struct hlcan_raw *raw = sl->raw;
 
-	spin_lock_bh(&sl->lock);
-	if (sl->tty) {
-		/* TTY discipline is running. */
-		clear_bit(TTY_DO_WRITE_WAKEUP, &sl->tty->flags);
-	}
-	netif_stop_queue(dev);
-	sl->rcount   = 0;
-	sl->xleft    = 0;
-	spin_unlock_bh(&sl->lock);
+	if (!raw)
+		return;
 
-	sl->can.state = CAN_STATE_STOPPED;
-	close_candev(dev);
+	misc_deregister(&raw->misc);
+	mutex_lock(&raw->lock);
+	WRITE_ONCE(raw->sl, NULL);
+	mutex_unlock(&raw->lock);
+	wake_up_interruptible(&raw->wait);
 
-	return 0;
+	sl->raw = NULL;
+	kref_put(&raw->ref, hlcan_raw_release);
 }
 
-/* Netdevice DOWN -> UP routine */
-static int slc_open(struct net_device *dev)
+/*
+ * Feed received bytes to the decoder, or to the RX thread if there is
+ * one. Returns how many were taken, none while RX is throttled. Called
+ * under rcu_read_lock by the tty or by the traffic generator, never by
+ * both at the same time.
+ */
+static int hlcan_rx_feed(struct slcan *sl, const unsigned char *cp,
+			 const char *fp, int count)
 {
-	int ret;
-	struct slcan *sl = netdev_priv(dev);
+	struct task_struct *task;
+	int done = 0;
 
-	if (sl->tty == NULL)
-		return -ENODEV;
+	if (test_bit(SLF_THROTTLED, &sl->rx_flags))
+		goto out;
 
-	/* Common open */
-	ret = open_candev(dev);
-	if (ret) {
-		return ret;
+	/* Leave the decoding to the RX thread if there is one */
+	task = rcu_dereference(sl->rx_task);
+	if (task) {
+		done = hlcan_rx_queue(sl, task, cp, fp, count);
+		goto out;
 	}
 
-	sl->flags &= (1 << SLF_INUSE);
-	sl->can.state = CAN_STATE_ERROR_ACTIVE;
-	netif_start_queue(dev);
-	return 0;
-}
+	hlcan_rx_resync(sl);
+	if (sl->lat)
+		sl->rx_chunk_ns = ktime_get_ns();
 
-static const struct net_device_ops slc_netdev_ops = {
-	.ndo_open               = slc_open,
-	.ndo_stop               = slc_close,
-	.ndo_start_xmit         = slc_xmit,
-	.ndo_change_mtu         = can_change_mtu,
-};
+	/* Read the characters out of the buffer */
+	while (done < count && !test_bit(SLF_THROTTLED, &sl->rx_flags)) {
+		if (fp && fp[done]) {
+			sl->rx_pos++;
+			hlcan_rx_error(sl);
+			done++;
+			continue;
+		}
+		slcan_unesc(sl, cp[done++]);
+	}
 
+out:
+	if (count - done > sl->rx_backlog_hwm)
+		sl->rx_backlog_hwm = count - done;
 
-/******************************************
-  Routines looking at TTY side.
- ******************************************/
+	return done;
+}
 
 /*
  * Handle the 'receiver data ready' interrupt.
@@ -525,8 +2813,11 @@ static const struct net_device_ops slc_netdev_ops = {
  * and sent on to some IP layer for further processing. This will not
  * be re-entered while running but other ldisc functions may be called
  * in parallel
+ *
+ * Returns the number of bytes consumed. While RX is throttled the rest
+ * is left in the tty buffers and handed to us again later.
  */
-static void slcan_receive_buf(struct tty_struct *tty,
+static int slcan_receive_buf2(struct tty_struct *tty,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
 			      const unsigned char *cp, const char *fp, int count)
 #else
@@ -534,48 +2825,224 @@ static void slcan_receive_buf(struct tty_struct *tty,
 #endif
 {
 	struct slcan *sl = (struct slcan *) tty->disc_data;
+	int done;
 
 	if (!sl || sl->magic != HLCAN_MAGIC || !netif_running(sl->dev)){
 		printk("hlcan: Serial device not ready\n");
-		return;
+		return count;
 	}
 
-	/* Read the characters out of the buffer */
-	while (count--) {
-		if (fp && *fp++) {
-			if (!test_and_set_bit(SLF_ERROR, &sl->flags))
-				sl->dev->stats.rx_errors++;
-			cp++;
+	trace_hlcan_rx_chunk(sl->dev->base_addr, count, sl->rx_pos);
+
+	rcu_read_lock();
+	/* The traffic generator has the decoder to itself while it runs */
+	if (test_bit(SLF_GEN, &sl->rx_flags))
+		done = count;
+	else
+		done = hlcan_rx_feed(sl, cp, fp, count);
+	rcu_read_unlock();
+
+	/* What was left for later comes again, so only copy what was taken */
+	if (sl->raw && done > 0)
+		hlcan_raw_capture(sl->raw, cp, fp, done);
+
+	if (test_bit(SLF_THROTTLED, &sl->rx_flags))
+		hlcan_tty_throttle(sl, tty);
+
+	return done;
+}
+
+/************************************************************************
+ *			TRAFFIC GENERATOR				*
+ ************************************************************************/
+
+/*
+ * Synthetic HL-340 byte streams for benchmarks without an adapter. The
+ * generator is set up through debugfs in hlcan/<tty>/gen/ and feeds the
+ * same path as slcan_receive_buf2(). Data from the tty is discarded
+ * while it runs.
+ */
+static u32 hlcan_gen_rand(u32 *state)
+{
+	u32 x = *state;
+
+	/* xorshift32 */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static int hlcan_gen_frame(struct hlcan_gen *g, unsigned char *buf, u32 *rnd)
+{
+	u32 id_count = max(READ_ONCE(g->id_count), 1U);
+	u32 id = READ_ONCE(g->id_base) + hlcan_gen_rand(rnd) % id_count;
+	u32 ppm = READ_ONCE(g->corrupt_ppm);
+	u32 dlc_min = min(READ_ONCE(g->dlc_min), (u32)CAN_MAX_DLEN);
+	u32 dlc_max = clamp(READ_ONCE(g->dlc_max), dlc_min, (u32)CAN_MAX_DLEN);
+	bool ext = hlcan_gen_rand(rnd) % 100 < READ_ONCE(g->ext_pct);
+	u8 dlc = dlc_min + hlcan_gen_rand(rnd) % (dlc_max - dlc_min + 1);
+	u32 data[2] = { hlcan_gen_rand(rnd), hlcan_gen_rand(rnd) };
+	int len;
+
+	len = hlcan_data_frame(buf, id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK),
+			       ext, 0, dlc, (u8 *)data);
+
+	if (ppm && hlcan_gen_rand(rnd) % 1000000 < ppm) {
+		buf[hlcan_gen_rand(rnd) % len] ^= 1 + hlcan_gen_rand(rnd) % 255;
+		g->corrupted++;
+	}
+
+	return len;
+}
+
+static int hlcan_gen_thread(void *data)
+{
+	struct slcan *sl = data;
+	struct hlcan_gen *g = &sl->gen;
+	u32 rnd = (u32)ktime_get_ns() | 1;
+	u64 start = ktime_get_ns(), sent = 0;
+
+	while (!kthread_should_stop()) {
+		u32 rate = READ_ONCE(g->rate);
+		u32 burst = clamp(READ_ONCE(g->burst), 1U, (u32)HLCAN_GEN_BURST_MAX);
+		int len = 0, done = 0, i;
+		u64 due, now;
+
+		if (!netif_running(sl->dev)) {
+			schedule_timeout_interruptible(HZ / 10);
+			start = ktime_get_ns();
+			sent = 0;
 			continue;
 		}
-		slcan_unesc(sl, *cp++);
+
+		for (i = 0; i < burst; i++)
+			len += hlcan_gen_frame(g, g->buf + len, &rnd);
+
+		while (done < len && !kthread_should_stop()) {
+			rcu_read_lock();
+			done += hlcan_rx_feed(sl, g->buf + done, NULL, len - done);
+			rcu_read_unlock();
+			/* throttled, wait for hlcan_rx_kick() */
+			if (done < len)
+				schedule_timeout_interruptible(1);
+		}
+
+		g->frames += burst;
+		g->bytes += len;
+		sent += burst;
+
+		if (!rate) {
+			cond_resched();
+			continue;
+		}
+
+		now = ktime_get_ns();
+		due = start + div_u64(sent * NSEC_PER_SEC, rate);
+		if (due > now + NSEC_PER_USEC * 10)
+			usleep_range(div_u64(due - now, NSEC_PER_USEC),
+				     div_u64(due - now, NSEC_PER_USEC) + 50);
+		else
+			cond_resched();
 	}
-}
 
-/************************************
- *  slcan_open helper routines.
- ************************************/
+	return 0;
+}
 
-/* Collect hanged up channels */
-static void slc_sync(void)
+/* Called with gen.lock held */
+static int hlcan_gen_start(struct slcan *sl)
 {
-	int i;
-	struct net_device *dev;
-	struct slcan	  *sl;
+	struct hlcan_gen *g = &sl->gen;
+	struct task_struct *task;
 
-	for (i = 0; i < maxdev; i++) {
-		dev = slcan_devs[i];
-		if (dev == NULL)
-			break;
+	if (g->task)
+		return 0;
 
-		sl = netdev_priv(dev);
-		if (sl->tty)
-			continue;
-		if (dev->flags & IFF_UP)
-			dev_close(dev);
+	g->buf = kmalloc(HLCAN_GEN_BURST_MAX * HLCAN_DATA_FRAME_MAX, GFP_KERNEL);
+	if (!g->buf)
+		return -ENOMEM;
+
+	/* Wait for the tty to leave the decoder, then start clean */
+	set_bit(SLF_GEN, &sl->rx_flags);
+	synchronize_rcu();
+	set_bit(SLF_RESYNC, &sl->rx_flags);
+
+	task = kthread_run(hlcan_gen_thread, sl, "%s-gen", sl->dev->name);
+	if (IS_ERR(task)) {
+		clear_bit(SLF_GEN, &sl->rx_flags);
+		kfree(g->buf);
+		g->buf = NULL;
+		return PTR_ERR(task);
 	}
+
+	g->task = task;
+	return 0;
+}
+
+/* Called with gen.lock held */
+static void hlcan_gen_stop(struct slcan *sl)
+{
+	struct hlcan_gen *g = &sl->gen;
+
+	if (!g->task)
+		return;
+
+	kthread_stop(g->task);
+	g->task = NULL;
+	kfree(g->buf);
+	g->buf = NULL;
+
+	set_bit(SLF_RESYNC, &sl->rx_flags);
+	clear_bit(SLF_GEN, &sl->rx_flags);
+}
+
+static int hlcan_gen_run_get(void *data, u64 *val)
+{
+	struct slcan *sl = data;
+
+	*val = !!READ_ONCE(sl->gen.task);
+	return 0;
+}
+
+static int hlcan_gen_run_set(void *data, u64 val)
+{
+	struct slcan *sl = data;
+	int err = 0;
+
+	mutex_lock(&sl->gen.lock);
+	if (val)
+		err = hlcan_gen_start(sl);
+	else
+		hlcan_gen_stop(sl);
+	mutex_unlock(&sl->gen.lock);
+
+	return err;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(hlcan_gen_run_fops, hlcan_gen_run_get,
+			 hlcan_gen_run_set, "%llu\n");
+
+static void hlcan_gen_debugfs(struct slcan *sl)
+{
+	struct hlcan_gen *g = &sl->gen;
+	struct dentry *dir = debugfs_create_dir("gen", sl->debugfs);
+
+	debugfs_create_file_unsafe("run", 0644, dir, sl, &hlcan_gen_run_fops);
+	debugfs_create_u32("rate", 0644, dir, &g->rate);
+	debugfs_create_u32("burst", 0644, dir, &g->burst);
+	debugfs_create_u32("id_base", 0644, dir, &g->id_base);
+	debugfs_create_u32("id_count", 0644, dir, &g->id_count);
+	debugfs_create_u32("ext_pct", 0644, dir, &g->ext_pct);
+	debugfs_create_u32("dlc_min", 0644, dir, &g->dlc_min);
+	debugfs_create_u32("dlc_max", 0644, dir, &g->dlc_max);
+	debugfs_create_u32("corrupt_ppm", 0644, dir, &g->corrupt_ppm);
+	debugfs_create_u64("frames", 0444, dir, &g->frames);
+	debugfs_create_u64("bytes", 0444, dir, &g->bytes);
+	debugfs_create_u64("corrupted", 0444, dir, &g->corrupted);
 }
 
+/************************************
+ *  slcan_open helper routines.
+ ************************************/
 
 static int hlcan_do_set_mode(struct net_device *dev, enum can_mode mode){
 	int ret;
@@ -583,15 +3050,39 @@ static int hlcan_do_set_mode(struct net_device *dev, enum can_mode mode){
 
 	switch (mode) {
 	case CAN_MODE_START:
+		/* Sending the settings again restarts the adapter's controller */
+		spin_lock_bh(&sl->tx_lock);
+		ret = hlcan_send_config(sl, sl->cfg_speed, sl->mode);
+		spin_unlock_bh(&sl->tx_lock);
+		if (ret)
+			return ret;
+
+		sl->bec.txerr = 0;
+		sl->bec.rxerr = 0;
 		sl->can.state = CAN_STATE_ERROR_ACTIVE;
-		return ret;
+		if (!test_bit(SLF_CONFIG, &sl->flags))
+			netif_wake_queue(dev);
+		return 0;
 	default:
 		return -EOPNOTSUPP;
 	}
 }
 
+static int hlcan_get_berr_counter(const struct net_device *dev,
+				  struct can_berr_counter *bec)
+{
+	struct slcan *sl = netdev_priv(dev);
+
+	*bec = sl->bec;
+	return 0;
+}
+
 
-/* Find a free SLCAN channel, and link in this `tty' line. */
+/*
+ * Allocate a new SLCAN channel and reserve a channel number for it.
+ * Only the reservation takes global_lock, the netdev allocation may
+ * sleep and runs concurrently for all adapters being attached.
+ */
 static struct slcan *slc_alloc(void)
 {
 	int i;
@@ -599,58 +3090,84 @@ static struct slcan *slc_alloc(void)
 	struct net_device *dev = NULL;
 	struct slcan       *sl;
 
-	for (i = 0; i < maxdev; i++) {
-		dev = slcan_devs[i];
-		if (dev == NULL)
-			break;
-	}
-
-	/* Sorry, too many, all slots in use */
-	if (i >= maxdev)
-		return NULL;
-
-	sprintf(name, "hlcan%d", i);
 	dev = alloc_candev(sizeof(*sl), 1);
 	if (!dev)
-		return NULL;
+		return ERR_PTR(-ENOMEM);
 
 	sl = netdev_priv(dev);
 	
 	dev->netdev_ops = &slc_netdev_ops;
+	dev->ethtool_ops = &hlcan_ethtool_ops;
+	dev->sysfs_groups[0] = &hlcan_attr_group;
 	// Device does NOT echo on itself
 	// dev->flags |= IFF_ECHO;
 
-	/* this does not actually matter when we use the serial port */
-	/* todo set this to a propper value */
-	sl->can.clock.freq = 3686400000u;
-	sl->can.data_bittiming_const = &hlcan_bittiming_const;
-	sl->can.bittiming.bitrate = 800000;
+	/* the bitrate is unknown until hlcand or netlink provides it */
+	sl->can.clock.freq = HLCAN_CLOCK_FREQ;
+	sl->can.bittiming_const = &hlcan_bittiming_const;
+	sl->can.do_set_bittiming = hlcan_set_bittiming;
 	sl->can.do_set_mode = hlcan_do_set_mode;
+	sl->can.do_get_berr_counter = hlcan_get_berr_counter;
 	sl->can.ctrlmode_supported = CAN_CTRLMODE_LOOPBACK |
-		CAN_CTRLMODE_3_SAMPLES | 
-		CAN_CTRLMODE_FD |
 		CAN_CTRLMODE_LISTENONLY;
 
-	dev->base_addr = i;
-
 	/* Initialize channel control data */
 	sl->magic = HLCAN_MAGIC;
-	sl->rstate = NONE;
+	sl->rx.state = NONE;
 	sl->dev	= dev;
-	sl->mode = 0;
-	spin_lock_init(&sl->lock);
+	sl->mode = HLCAN_MODE_NORMAL;
+	sl->speed = HLCAN_SPEED_INVALID;
+	sl->cfg_speed = HLCAN_SPEED_INVALID;
+	sl->frame_type = HLCAN_FRAME_STANDARD;
+	sl->rx_cpu = -1;
+	mutex_init(&sl->gen.lock);
+	sl->gen.rate = 1000;
+	sl->gen.burst = 16;
+	sl->gen.id_base = 0x100;
+	sl->gen.id_count = 16;
+	sl->gen.dlc_max = CAN_MAX_DLEN;
+	spin_lock_init(&sl->tx_lock);
+	u64_stats_init(&sl->rx_syncp);
+	u64_stats_init(&sl->tx_syncp);
 	INIT_WORK(&sl->tx_work, slcan_transmit);
-	slcan_devs[i] = dev;
+	INIT_DELAYED_WORK(&sl->status_work, hlcan_status_poll);
+	INIT_DELAYED_WORK(&sl->rx_kick_work, hlcan_rx_kick);
+
+	/* Reserve the lowest free channel number */
+	idr_preload(GFP_KERNEL);
+	spin_lock_bh(&global_lock);
+	i = idr_alloc(&slcan_idr, dev, 0, maxdev > 0 ? maxdev : 0, GFP_NOWAIT);
+	spin_unlock_bh(&global_lock);
+	idr_preload_end();
+
+	/* Sorry, too many, all slots in use */
+	if (i < 0) {
+		free_candev(dev);
+		return ERR_PTR(i == -ENOSPC ? -ENFILE : i);
+	}
+
+	sprintf(name, "hlcan%d", i);
+	dev->base_addr = i;
 
 	return sl;
 }
 
-/* Hook the destructor so we can free slcan devs at the right point in time */
+/* Give the channel number of a netdev back to the registry */
 static void slc_free_netdev(struct net_device *dev)
 {
+	struct slcan *sl = netdev_priv(dev);
 	int i = dev->base_addr;
 
-	slcan_devs[i] = NULL;
+	debugfs_remove_recursive(sl->debugfs);
+	vfree(sl->rx_ids);
+	vfree(sl->tx_ids);
+	kfree(sl->lat);
+	vfree(rcu_access_pointer(sl->rx_change));
+	kfree(rcu_access_pointer(sl->rx_masks));
+
+	spin_lock_bh(&global_lock);
+	idr_remove(&slcan_idr, i);
+	spin_unlock_bh(&global_lock);
 }
 
 /*
@@ -661,6 +3178,8 @@ static void slc_free_netdev(struct net_device *dev)
  * a free SLCAN channel...
  *
  * Called in process context serialized from other ldisc calls.
+ * Opens on different ttys run in parallel, they are only serialized
+ * while reserving a channel number in slc_alloc().
  */
 static int slcan_open(struct tty_struct *tty)
 {
@@ -673,65 +3192,55 @@ static int slcan_open(struct tty_struct *tty)
 	if (tty->ops->write == NULL)
 		return -EOPNOTSUPP;
 
-	/* sync concurrent opens on global lock */
-	spin_lock_bh(&global_lock);
-
-	/* Collect hanged up channels. */
-	slc_sync();
-
 	sl = tty->disc_data;
 
-	err = -EEXIST;
 	/* First make sure we're not already connected. */
 	if (sl && sl->magic == HLCAN_MAGIC)
-		goto err_exit;
+		return -EEXIST;
 
 	/* OK.  Find a free SLCAN channel to use. */
-	err = -ENFILE;
 	sl = slc_alloc();
-	
+	if (IS_ERR(sl))
+		return PTR_ERR(sl);
+
 	SET_NETDEV_DEV(sl->dev, tty->dev);
-	if (sl == NULL) {
-		err = -ENOMEM;
-		goto err_exit;
-	}
 
+	/* Perform the low-level SLCAN initialization. */
 	sl->tty = tty;
-	tty->disc_data = sl;
+	sl->rx.count = 0;
+	sl->xleft    = 0;
+	set_bit(SLF_INUSE, &sl->flags);
 
-	if (!test_bit(SLF_INUSE, &sl->flags)) {
-		/* Perform the low-level SLCAN initialization. */
-		sl->rcount   = 0;
-		sl->xleft    = 0;
+	sl->debugfs = debugfs_create_dir(tty->name, hlcan_debugfs);
+	hlcan_gen_debugfs(sl);
+	if (id_stats && hlcan_id_stats_alloc(sl))
+		netdev_warn(sl->dev, "no memory for id_stats\n");
+	if (latency && hlcan_lat_alloc(sl))
+		netdev_warn(sl->dev, "no memory for latency histograms\n");
 
-		set_bit(SLF_INUSE, &sl->flags);
+	/* May sleep on rtnl, so this must not run under global_lock */
+	err = register_candev(sl->dev);
+	if (err)
+		goto err_free_chan;
 
-		err = register_candev(sl->dev);
-		if (err)
-			goto err_free_chan;
+	sl->candev_registered = 1;
 
-		sl->candev_registered = 1;
-	}
+	if (monitor)
+		hlcan_mon_create(sl);
+	if (raw_dev)
+		hlcan_raw_create(sl, tty);
 
 	/* Done.  We have linked the TTY line to a channel. */
-	spin_unlock_bh(&global_lock);
-	tty->receive_room = 65536;	/* We don't flow control */
+	tty->disc_data = sl;
 
 	/* TTY layer expects 0 on success */
 	return 0;
 
 err_free_chan:
 	sl->tty = NULL;
-	tty->disc_data = NULL;
 	clear_bit(SLF_INUSE, &sl->flags);
 	slc_free_netdev(sl->dev);
-	/* do not call free_netdev before rtnl_unlock */
-	rtnl_unlock();
-	free_netdev(sl->dev);
-
-err_exit:
-	spin_unlock_bh(&global_lock);
-	/* Count references from TTY module */
+	free_candev(sl->dev);
 	return err;
 }
 
@@ -751,17 +3260,46 @@ static void slcan_close(struct tty_struct *tty)
 	if (!sl || sl->magic != HLCAN_MAGIC || sl->tty != tty)
 		return;
 
-	spin_lock_bh(&sl->lock);
-	tty->disc_data = NULL;
+	/* No one can start the generator again once debugfs is gone */
+	debugfs_remove_recursive(sl->debugfs);
+	sl->debugfs = NULL;
+	mutex_lock(&sl->gen.lock);
+	hlcan_gen_stop(sl);
+	mutex_unlock(&sl->gen.lock);
+
+	spin_lock_bh(&sl->tx_lock);
+	rcu_assign_pointer(tty->disc_data, NULL);
 	sl->tty = NULL;
-	spin_unlock_bh(&sl->lock);
+	spin_unlock_bh(&sl->tx_lock);
 
+	/* Wait for write_wakeup users of disc_data before the last flush */
+	synchronize_rcu();
 	flush_work(&sl->tx_work);
 
+	/* Writers of the raw device see a detached channel from here on */
+	hlcan_raw_destroy(sl);
+
 	/* Flush network side */
 	unregister_candev(sl->dev);
 	sl->candev_registered = 0;
-	/* This will complete via sl_free_netdev */
+
+	if (sl->mon) {
+		unregister_netdev(sl->mon);
+		sl->mon = NULL;
+	}
+
+	/*
+	 * Receiving is over, leave the tty unthrottled for the next ldisc.
+	 * A kick that ran after sl->tty was cleared dropped SLF_THROTTLED
+	 * without unthrottling, so do not go by the flag.
+	 */
+	cancel_delayed_work_sync(&sl->rx_kick_work);
+	clear_bit(SLF_THROTTLED, &sl->rx_flags);
+	tty_unthrottle(tty);
+
+	/* Nothing is left to collect later, release the channel right here */
+	slc_free_netdev(sl->dev);
+	free_candev(sl->dev);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
@@ -776,6 +3314,36 @@ static int slcan_hangup(struct tty_struct *tty)
 #endif
 }
 
+/*
+ * Nothing is read through the tty, but hlcand polls it to learn that the
+ * channel is gone: the adapter was unplugged or the other end of a pty
+ * closed. The hangup wakes up read_wait.
+ */
+static __poll_t slcan_poll(struct tty_struct *tty, struct file *file,
+			   poll_table *wait)
+{
+	poll_wait(file, &tty->read_wait, wait);
+
+	if (tty_hung_up_p(file) || test_bit(TTY_OTHER_CLOSED, &tty->flags))
+		return EPOLLHUP;
+	return 0;
+}
+
+/*
+ * Check the argument of IO_CTL_CONFIG and IO_CTL_RECONFIG before any of
+ * it reaches the adapter. Returns the bitrate, 0 if it is not valid.
+ */
+static u32 hlcan_cfg_arg_bitrate(unsigned long arg)
+{
+	if (HLCAN_CFG_ARG_MODE(arg) > HLCAN_MODE_LOOPBACK_SILENT)
+		return 0;
+	if (HLCAN_CFG_ARG_FRAME(arg) != HLCAN_FRAME_STANDARD &&
+	    HLCAN_CFG_ARG_FRAME(arg) != HLCAN_FRAME_EXTENDED)
+		return 0;
+
+	return hlcan_speed_to_bitrate(HLCAN_CFG_ARG_SPEED(arg));
+}
+
 /* Perform I/O control on an active SLCAN channel. */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
 static int slcan_ioctl(struct tty_struct *tty,
@@ -786,24 +3354,68 @@ static int slcan_ioctl(struct tty_struct *tty, struct file *file,
 #endif
 {
 	struct slcan *sl = (struct slcan *) tty->disc_data;
+	unsigned int tmp;
+	int ret;
 
 	/* First make sure we're connected. */
 	if (!sl || sl->magic != HLCAN_MAGIC)
 		return -EINVAL;
 
 	switch (cmd) {
+	case SIOCGIFNAME:
+		tmp = strlen(sl->dev->name) + 1;
+		if (copy_to_user((void __user *)arg, sl->dev->name, tmp))
+			return -EFAULT;
+		return 0;
+
 	case SIOCSIFHWADDR:
 		return -EINVAL;
 
 	case IO_CTL_MODE:
-		sl->mode = arg;
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+
+		if (!rtnl_trylock())
+			return restart_syscall();
+		hlcan_apply_mode(sl, arg);
+		rtnl_unlock();
 		printk("hlcan: new device mode %i\n", sl->mode);
-		if (sl->mode == 1 || sl->mode == 3){
-			sl->dev->flags |= IFF_ECHO;
-		}
-			
 		return 0;
 
+	case IO_CTL_CONFIG:
+		/* hlcand has set up the adapter before attaching */
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+
+		tmp = hlcan_cfg_arg_bitrate(arg);
+		if (!tmp)
+			return -EINVAL;
+
+		if (!rtnl_trylock())
+			return restart_syscall();
+		sl->speed = HLCAN_CFG_ARG_SPEED(arg);
+		sl->cfg_speed = sl->speed;
+		sl->frame_type = HLCAN_CFG_ARG_FRAME(arg);
+		sl->can.bittiming.bitrate = tmp;
+		hlcan_apply_mode(sl, HLCAN_CFG_ARG_MODE(arg));
+		rtnl_unlock();
+		return 0;
+
+	case IO_CTL_RECONFIG:
+		if (!capable(CAP_NET_ADMIN))
+			return -EPERM;
+
+		if (!hlcan_cfg_arg_bitrate(arg))
+			return -EINVAL;
+
+		if (!rtnl_trylock())
+			return restart_syscall();
+		ret = hlcan_reconfigure(sl, HLCAN_CFG_ARG_SPEED(arg),
+					HLCAN_CFG_ARG_MODE(arg),
+					HLCAN_CFG_ARG_FRAME(arg));
+		rtnl_unlock();
+		return ret;
+
 	default:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
 		return tty_mode_ioctl(tty, cmd, arg);
@@ -827,8 +3439,9 @@ static struct tty_ldisc_ops slc_ldisc = {
 	.open		= slcan_open,
 	.close		= slcan_close,
 	.hangup		= slcan_hangup,
+	.poll		= slcan_poll,
 	.ioctl		= slcan_ioctl,
-	.receive_buf	= slcan_receive_buf,
+	.receive_buf2	= slcan_receive_buf2,
 	.write_wakeup	= slcan_write_wakeup,
 };
 
@@ -836,15 +3449,16 @@ static int __init slcan_init(void)
 {
 	int status;
 
-	if (maxdev < 4)
-		maxdev = 4; /* Sanity */
+	if (maxdev < 0)
+		maxdev = 0; /* Sanity */
 
 	pr_info("hlcan: QinHeng serial line CAN interface driver\n");
-	pr_info("hlcan: %d dynamic interface channels.\n", maxdev);
+	if (maxdev)
+		pr_info("hlcan: %d dynamic interface channels.\n", maxdev);
+	else
+		pr_info("hlcan: unlimited dynamic interface channels.\n");
 
-	slcan_devs = kcalloc(maxdev, sizeof(struct net_device *), GFP_KERNEL);
-	if (!slcan_devs)
-		return -ENOMEM;
+	hlcan_debugfs = debugfs_create_dir(DRV_NAME, NULL);
 
 	/* Fill in our line protocol discipline, and register it */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
@@ -854,7 +3468,7 @@ static int __init slcan_init(void)
 #endif
 	if (status)  {
 		printk(KERN_ERR "hlcan: can't register line discipline\n");
-		kfree(slcan_devs);
+		debugfs_remove_recursive(hlcan_debugfs);
 	}
 	spin_lock_init(&global_lock);
 
@@ -869,9 +3483,6 @@ static void __exit slcan_exit(void)
 	int busy = 0;
 	int i;
 
-	if (slcan_devs == NULL)
-		return;
-
 	/*
 	 * First of all: check for active disciplines and hangup them.
 	 */
@@ -880,30 +3491,23 @@ static void __exit slcan_exit(void)
 			msleep_interruptible(100);
 
 		busy = 0;
-		for (i = 0; i < maxdev; i++) {
-			dev = slcan_devs[i];
-			if (!dev)
-				continue;
+		spin_lock_bh(&global_lock);
+		idr_for_each_entry(&slcan_idr, dev, i) {
 			sl = netdev_priv(dev);
-			spin_lock_bh(&sl->lock);
+			spin_lock(&sl->tx_lock);
 			if (sl->tty) {
 				busy++;
 				tty_hangup(sl->tty);
 			}
-			spin_unlock_bh(&sl->lock);
+			spin_unlock(&sl->tx_lock);
 		}
+		spin_unlock_bh(&global_lock);
 	} while (busy && time_before(jiffies, timeout));
 
 	/* FIXME: hangup is async so we should wait when doing this second
 	   phase */
 
-	for (i = 0; i < maxdev; i++) {
-		dev = slcan_devs[i];
-		if (!dev)
-			continue;
-
-		slcan_devs[i] = NULL;
-
+	idr_for_each_entry(&slcan_idr, dev, i) {
 		sl = netdev_priv(dev);
 		if (sl->tty) {
 			printk(KERN_ERR "%s: tty discipline still running\n",
@@ -914,8 +3518,7 @@ static void __exit slcan_exit(void)
 			unregister_candev(dev);
 	}
 
-	kfree(slcan_devs);
-	slcan_devs = NULL;
+	idr_destroy(&slcan_idr);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
 	tty_unregister_ldisc(&slc_ldisc);
@@ -924,6 +3527,8 @@ static void __exit slcan_exit(void)
 	if (i)
 		printk(KERN_ERR "hlcan: can't unregister ldisc (err %d)\n", i);
 #endif
+
+	debugfs_remove_recursive(hlcan_debugfs);
 }
 
 module_init(slcan_init);
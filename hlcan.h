@@ -1,3 +1,8 @@
+#ifndef HLCAN_H
+#define HLCAN_H
+
+#include <linux/types.h>
+
 #define N_HLCAN		N_SLCAN 	/* line discipline for hlcan, value not used in kernel */
 
 #define HLCAN_MAGIC 0x53DA
@@ -13,8 +18,31 @@
 #define HLCAN_CFG_PACKAGE_TYPE	0x55
 #define HLCAN_CFG_PACKAGE_LEN	0x14
 #define HLCAN_CFG_CRC_IDX		0x02
+#define HLCAN_CFG_TYPE_SETTINGS	0x12
+#define HLCAN_CFG_TYPE_STATUS	0x04
+
+/*
+ * Status request and reply. The vendor protocol has neither, adapters
+ * that answer use the type byte HLCAN_CFG_TYPE_STATUS. The offsets of
+ * REC, TEC and the flags are assumed, not documented anywhere.
+ */
+#define HLCAN_STATUS_REC_IDX	0x03
+#define HLCAN_STATUS_TEC_IDX	0x04
+#define HLCAN_STATUS_FLAGS_IDX	0x05
+#define HLCAN_STATUS_BUS_OFF	0x01
 
 #define IO_CTL_MODE             0xF3
+#define IO_CTL_CONFIG           0xF4	/* tell the ldisc how the adapter is set up */
+#define IO_CTL_RECONFIG         0xF5	/* change settings of a running channel */
+
+/* argument of IO_CTL_CONFIG and IO_CTL_RECONFIG */
+#define HLCAN_CFG_ARG(speed, mode, frame)	\
+	((unsigned long)(speed) |		\
+	 ((unsigned long)(mode) << 8) |		\
+	 ((unsigned long)(frame) << 16))
+#define HLCAN_CFG_ARG_SPEED(arg)	((arg) & 0xff)
+#define HLCAN_CFG_ARG_MODE(arg)		(((arg) >> 8) & 0xff)
+#define HLCAN_CFG_ARG_FRAME(arg)	(((arg) >> 16) & 0xff)
 
 typedef enum {
 	NONE,
@@ -50,3 +78,331 @@ typedef enum {
     HLCAN_FRAME_STANDARD = 0x01,
     HLCAN_FRAME_EXTENDED = 0x02,
 } HLCAN_FRAME_TYPE;
+
+/* return values of a BPF program attached to hlcan_rx_hook() */
+#define HLCAN_HOOK_PASS		0		/* deliver the frame */
+#define HLCAN_HOOK_DROP		(-1)		/* any negative value drops it */
+#define HLCAN_HOOK_MIRROR	0x40000000	/* or'ed to an ifindex: send a copy there and pass */
+/* any other positive value is the ifindex of a CAN interface to send the frame to */
+
+#ifdef __KERNEL__
+struct net_device;
+struct can_frame;
+
+/* attach point for the BPF program, see the rx_hook module parameter */
+int hlcan_rx_hook(struct net_device *dev, const struct can_frame *cf);
+#endif
+
+/*
+ * Ring of the raw passthrough device /dev/hlcan/<tty>, mapped with mmap.
+ * The mapping starts with struct hlcan_raw_ring, the data area follows
+ * at data_offset. It holds records of struct hlcan_raw_record and the
+ * bytes that came in, each padded to HLCAN_RAW_ALIGN. A record with len
+ * 0 pads up to the end of the data area. The kernel only writes records
+ * between tail and tail + size, the reader moves tail on as it consumes
+ * them. Chunks that do not fit are dropped and counted in lost_*.
+ * head and tail are free running byte counts, use them modulo size.
+ */
+#define HLCAN_RAW_ALIGN		16
+#define HLCAN_RAW_ERROR		0x01	/* the tty flagged an error in this chunk */
+
+struct hlcan_raw_ring {
+	__u32 head;		/* written by the kernel, end of the last record */
+	__u32 tail;		/* written by the reader, end of what it consumed */
+	__u32 size;		/* size of the data area, a power of 2 */
+	__u32 data_offset;	/* offset of the data area in the mapping */
+	__u64 lost_chunks;
+	__u64 lost_bytes;
+};
+
+struct hlcan_raw_record {
+	__u64 ts_ns;		/* CLOCK_MONOTONIC when the chunk came in */
+	__u32 len;		/* bytes following the record, 0 = padding */
+	__u32 flags;		/* HLCAN_RAW_ERROR */
+};
+
+/* record of the id_stats.bin debugfs file, in host byte order */
+#define HLCAN_ID_RX		0
+#define HLCAN_ID_TX		1
+
+struct hlcan_id_record {
+	__u32 id;		/* can_id, CAN_EFF_FLAG included */
+	__u8 dir;		/* HLCAN_ID_RX or HLCAN_ID_TX */
+	__u8 pad[3];
+	__u64 frames;
+	__u64 bytes;
+	__u64 last_ns;		/* CLOCK_MONOTONIC of the last frame */
+	__u64 min_gap_ns;	/* inter-arrival times, 0 below 2 frames */
+	__u64 mean_gap_ns;
+	__u64 max_gap_ns;
+	__u32 dlc[9];		/* frames per DLC */
+	__u32 pad2;
+};
+
+/*
+ * length of a data frame with the given type byte, start and end code
+ * included. RTR frames carry a DLC but no data bytes.
+ */
+static inline int hlcan_data_frame_len(unsigned char type)
+{
+	return 1 + /* HLCAN_PACKET_START */
+		1 + /* type byte */
+		((type & HLCAN_FLAG_ID_EXT) ? 4 : 2) +
+		((type & HLCAN_FLAG_RTR) ? 0 : (type & 0x0f)) +
+		1; /* HLCAN_PACKET_END */
+}
+
+/* longest data frame: extended id and 8 data bytes */
+#define HLCAN_DATA_FRAME_MAX	(1 + 1 + 4 + 8 + 1)
+
+/* fill buf with a data frame, buf must hold HLCAN_DATA_FRAME_MAX bytes */
+static inline int hlcan_data_frame(unsigned char *buf, unsigned int id,
+				   int ext, int rtr, unsigned char dlc,
+				   const unsigned char *data)
+{
+	int len = 0, i;
+
+	buf[len++] = HLCAN_PACKET_START;
+	buf[len++] = HLCAN_FRAME_PREFIX |
+		(ext ? HLCAN_FLAG_ID_EXT : 0) |
+		(rtr ? HLCAN_FLAG_RTR : 0) |
+		dlc;
+	buf[len++] = id & 0xff;
+	buf[len++] = (id >> 8) & 0xff;
+	if (ext) {
+		buf[len++] = (id >> 16) & 0xff;
+		buf[len++] = (id >> 24) & 0xff;
+	}
+
+	/* RTR frames may have a dlc > 0 but they never have any data bytes */
+	if (!rtr)
+		for (i = 0; i < dlc; i++)
+			buf[len++] = data[i];
+
+	buf[len++] = HLCAN_PACKET_END;
+
+	return len;
+}
+
+/* the adapter never sends more, a longer dlc means the stream is off */
+#define HLCAN_DLC_MAX		8
+
+/*
+ * State of the packet that starts at buf, count bytes of it are there.
+ * Sets len to the packet length once the type byte is known, else 0.
+ * MISSED_HEADER: buf does not start with a packet, NONE: unknown type.
+ */
+static inline FRAME_STATE hlcan_rx_state(const unsigned char *buf, int count,
+					 int *len)
+{
+	*len = 0;
+	if (count > 0 && buf[0] != HLCAN_PACKET_START)
+		return MISSED_HEADER;
+	if (count < 2)
+		return RECEIVING;
+
+	if (buf[1] == HLCAN_CFG_PACKAGE_TYPE)
+		*len = HLCAN_CFG_PACKAGE_LEN;
+	else if ((buf[1] & 0xc0) == HLCAN_FRAME_PREFIX &&
+		 (buf[1] & 0x0f) <= HLCAN_DLC_MAX)
+		*len = hlcan_data_frame_len(buf[1]);
+	else
+		return NONE;
+
+	return count >= *len ? COMPLETE : RECEIVING;
+}
+
+/*
+ * Split a complete data frame into its parts, the reverse of
+ * hlcan_data_frame(). data receives HLCAN_DLC_MAX bytes, the payload
+ * padded with zeros. Returns the dlc.
+ */
+static inline int hlcan_parse_data_frame(const unsigned char *buf, __u32 *id,
+					 int *ext, int *rtr,
+					 unsigned char *data)
+{
+	int dlc = buf[1] & 0x0f, pos = 4, i;
+
+	*ext = !!(buf[1] & HLCAN_FLAG_ID_EXT);
+	*rtr = !!(buf[1] & HLCAN_FLAG_RTR);
+	*id = buf[2] | buf[3] << 8;
+	if (*ext) {
+		*id |= (__u32)buf[4] << 16 | (__u32)buf[5] << 24;
+		*id &= 0x1fffffff;	/* CAN_EFF_MASK */
+		pos = 6;
+	} else {
+		*id &= 0x7ff;		/* CAN_SFF_MASK */
+	}
+
+	/* RTR frames may have a dlc > 0 but they never have any data bytes */
+	for (i = 0; i < HLCAN_DLC_MAX; i++)
+		data[i] = !*rtr && i < dlc ? buf[pos + i] : 0;
+
+	return dlc;
+}
+
+/*
+ * Stream decoder. The ldisc and the tools in bin/ feed it the bytes
+ * from the adapter one at a time with hlcan_rx_byte().
+ */
+#define HLCAN_RX_BUF_LEN	128
+
+struct hlcan_rx {
+	unsigned char buf[HLCAN_RX_BUF_LEN];
+	int count;		/* bytes of the current packet in buf */
+	int expected;		/* its length, 0 while not known */
+	FRAME_STATE state;
+	int skip;		/* drop the next byte */
+};
+
+/* what hlcan_rx_byte() did with a byte */
+enum hlcan_rx_result {
+	HLCAN_RX_MORE,		/* kept, the packet is not complete yet */
+	HLCAN_RX_PACKET,	/* completed a packet of *len bytes in buf */
+	HLCAN_RX_SKIPPED,	/* dropped, it followed an error */
+	HLCAN_RX_NO_HEADER,	/* dropped with *len bytes, no packet start */
+	HLCAN_RX_BAD_TYPE,	/* dropped with *len bytes, unknown type */
+	HLCAN_RX_OVERRUN,	/* buf was full, it and *len bytes dropped */
+};
+
+/* start over, returns the bytes of a half decoded packet thrown away */
+static inline int hlcan_rx_reset(struct hlcan_rx *rx)
+{
+	int count = rx->count;
+
+	rx->count = 0;
+	rx->expected = 0;
+	rx->state = NONE;
+	rx->skip = 0;
+
+	return count;
+}
+
+/*
+ * The tty flagged a byte, the caller drops it and the decoder drops
+ * the one after it. Returns 0 if the byte before was flagged as well.
+ */
+static inline int hlcan_rx_flag_error(struct hlcan_rx *rx)
+{
+	int first = !rx->skip;
+
+	rx->skip = 1;
+	return first;
+}
+
+/*
+ * Add a byte to the packet in rx->buf. A complete packet stays in buf
+ * until the next call, *len is set for every result but HLCAN_RX_MORE
+ * and HLCAN_RX_SKIPPED.
+ */
+static inline enum hlcan_rx_result hlcan_rx_byte(struct hlcan_rx *rx,
+						 unsigned char c, int *len)
+{
+	enum hlcan_rx_result ret;
+
+	if (rx->skip) {
+		rx->skip = 0;
+		return HLCAN_RX_SKIPPED;
+	}
+
+	/* Packets are not longer than 20 bytes, so this is a decoder bug */
+	if (rx->count >= HLCAN_RX_BUF_LEN) {
+		*len = rx->count;
+		rx->count = 0;
+		rx->expected = 0;
+		rx->skip = 1;
+		return HLCAN_RX_OVERRUN;
+	}
+
+	rx->buf[rx->count++] = c;
+
+	/* Only check the state again after enough bytes came in */
+	if (rx->state == RECEIVING && rx->expected > 0 &&
+	    rx->count < rx->expected)
+		return HLCAN_RX_MORE;
+
+	rx->state = hlcan_rx_state(rx->buf, rx->count, &rx->expected);
+	switch (rx->state) {
+	case COMPLETE:
+		ret = HLCAN_RX_PACKET;
+		break;
+	case MISSED_HEADER:
+		/* Need to sync on 0xaa at the start of a packet */
+		ret = HLCAN_RX_NO_HEADER;
+		break;
+	case NONE:
+		/* Unknown type byte, look for the next packet start */
+		ret = HLCAN_RX_BAD_TYPE;
+		break;
+	default:
+		return HLCAN_RX_MORE;
+	}
+
+	*len = rx->count;
+	rx->count = 0;
+	rx->expected = 0;
+	return ret;
+}
+
+/* checksum of a settings packet, sum of the bytes after the header */
+static inline unsigned char hlcan_cfg_crc(const unsigned char *data)
+{
+	unsigned char i, checksum = 0;
+
+	for (i = HLCAN_CFG_CRC_IDX;
+			i < HLCAN_CFG_PACKAGE_LEN - HLCAN_CFG_CRC_IDX - 1;
+			++i) {
+		checksum += *(data + i);
+	}
+
+	return checksum & 0xff;
+}
+
+/* fill buf with a settings packet, buf must hold HLCAN_CFG_PACKAGE_LEN bytes */
+static inline int hlcan_cfg_packet(unsigned char *buf,
+				   HLCAN_SPEED speed,
+				   HLCAN_MODE mode,
+				   HLCAN_FRAME_TYPE frame)
+{
+	int len = 0;
+
+	buf[len++] = HLCAN_PACKET_START;
+	buf[len++] = HLCAN_CFG_PACKAGE_TYPE;
+	buf[len++] = HLCAN_CFG_TYPE_SETTINGS;
+	buf[len++] = speed;
+	buf[len++] = frame;
+	buf[len++] = 0; /* Filter ID not handled. */
+	buf[len++] = 0; /* Filter ID not handled. */
+	buf[len++] = 0; /* Filter ID not handled. */
+	buf[len++] = 0; /* Filter ID not handled. */
+	buf[len++] = 0; /* Mask ID not handled. */
+	buf[len++] = 0; /* Mask ID not handled. */
+	buf[len++] = 0; /* Mask ID not handled. */
+	buf[len++] = 0; /* Mask ID not handled. */
+	buf[len++] = mode;
+	buf[len++] = 0x01; // ?
+	buf[len++] = 0;
+	buf[len++] = 0;
+	buf[len++] = 0;
+	buf[len++] = 0;
+	buf[len++] = hlcan_cfg_crc(buf);
+
+	return len;
+}
+
+/* fill buf with a status request, the adapter answers with a status packet */
+static inline int hlcan_status_packet(unsigned char *buf)
+{
+	int len = 0;
+
+	buf[len++] = HLCAN_PACKET_START;
+	buf[len++] = HLCAN_CFG_PACKAGE_TYPE;
+	buf[len++] = HLCAN_CFG_TYPE_STATUS;
+	while (len < HLCAN_CFG_PACKAGE_LEN - 1)
+		buf[len++] = 0;
+	buf[len++] = hlcan_cfg_crc(buf);
+
+	return len;
+}
+
+#endif /* HLCAN_H */
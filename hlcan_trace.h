@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the hlcan receive and transmit paths.
+ *
+ * channel is the index of hlcanN, pos the offset in the byte stream of
+ * the channel, counted from when it was attached.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hlcan
+
+#if !defined(_HLCAN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HLCAN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A chunk of bytes from the tty, before any of it is decoded */
+TRACE_EVENT(hlcan_rx_chunk,
+	TP_PROTO(int channel, int count, u64 pos),
+	TP_ARGS(channel, count, pos),
+
+	TP_STRUCT__entry(
+		__field(int,	channel)
+		__field(int,	count)
+		__field(u64,	pos)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->count = count;
+		__entry->pos = pos;
+	),
+
+	TP_printk("hlcan%d count=%d pos=%llu",
+		  __entry->channel, __entry->count, __entry->pos)
+);
+
+/* An adapter packet was received in full, type is its second byte */
+TRACE_EVENT(hlcan_rx_packet,
+	TP_PROTO(int channel, u8 type, int len, u64 pos),
+	TP_ARGS(channel, type, len, pos),
+
+	TP_STRUCT__entry(
+		__field(int,	channel)
+		__field(u8,	type)
+		__field(int,	len)
+		__field(u64,	pos)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->type = type;
+		__entry->len = len;
+		__entry->pos = pos;
+	),
+
+	TP_printk("hlcan%d type=0x%02x len=%d pos=%llu",
+		  __entry->channel, __entry->type, __entry->len, __entry->pos)
+);
+
+DECLARE_EVENT_CLASS(hlcan_frame,
+	TP_PROTO(int channel, canid_t can_id, u8 dlc, u64 pos),
+	TP_ARGS(channel, can_id, dlc, pos),
+
+	TP_STRUCT__entry(
+		__field(int,		channel)
+		__field(canid_t,	can_id)
+		__field(u8,		dlc)
+		__field(u64,		pos)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->can_id = can_id;
+		__entry->dlc = dlc;
+		__entry->pos = pos;
+	),
+
+	TP_printk("hlcan%d can_id=0x%08x dlc=%u pos=%llu",
+		  __entry->channel, __entry->can_id, __entry->dlc,
+		  __entry->pos)
+);
+
+/* slc_bump() decoded a data frame that started at pos */
+DEFINE_EVENT(hlcan_frame, hlcan_rx_frame,
+	TP_PROTO(int channel, canid_t can_id, u8 dlc, u64 pos),
+	TP_ARGS(channel, can_id, dlc, pos)
+);
+
+/* slc_xmit() got a frame, pos is how far the TX stream got so far */
+DEFINE_EVENT(hlcan_frame, hlcan_xmit,
+	TP_PROTO(int channel, canid_t can_id, u8 dlc, u64 pos),
+	TP_ARGS(channel, can_id, dlc, pos)
+);
+
+#define HLCAN_DISCARD_REASONS				\
+	EM(HLCAN_DISCARD_RESYNC,	"resync")	\
+	EM(HLCAN_DISCARD_NO_HEADER,	"no_header")	\
+	EM(HLCAN_DISCARD_BAD_TYPE,	"bad_type")	\
+	EM(HLCAN_DISCARD_OVERRUN,	"overrun")	\
+	EMe(HLCAN_DISCARD_TTY_ERROR,	"tty_error")
+
+#ifndef _HLCAN_TRACE_ENUMS
+#define _HLCAN_TRACE_ENUMS
+#undef EM
+#undef EMe
+#define EM(a, b)	a,
+#define EMe(a, b)	a
+
+enum hlcan_discard { HLCAN_DISCARD_REASONS };
+#endif
+
+#undef EM
+#undef EMe
+#define EM(a, b)	TRACE_DEFINE_ENUM(a);
+#define EMe(a, b)	TRACE_DEFINE_ENUM(a);
+
+HLCAN_DISCARD_REASONS
+
+#undef EM
+#undef EMe
+#define EM(a, b)	{ a, b },
+#define EMe(a, b)	{ a, b }
+
+/* Bytes thrown away by the decoder, they ended at pos */
+TRACE_EVENT(hlcan_rx_discard,
+	TP_PROTO(int channel, int reason, int count, u64 pos),
+	TP_ARGS(channel, reason, count, pos),
+
+	TP_STRUCT__entry(
+		__field(int,	channel)
+		__field(int,	reason)
+		__field(int,	count)
+		__field(u64,	pos)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->reason = reason;
+		__entry->count = count;
+		__entry->pos = pos;
+	),
+
+	TP_printk("hlcan%d reason=%s count=%d pos=%llu",
+		  __entry->channel,
+		  __print_symbolic(__entry->reason, HLCAN_DISCARD_REASONS),
+		  __entry->count, __entry->pos)
+);
+
+/* slc_encaps() handed len bytes to the tty, which took actual of them */
+TRACE_EVENT(hlcan_encaps,
+	TP_PROTO(int channel, canid_t can_id, u8 dlc, int len, int actual,
+		 u64 pos),
+	TP_ARGS(channel, can_id, dlc, len, actual, pos),
+
+	TP_STRUCT__entry(
+		__field(int,		channel)
+		__field(canid_t,	can_id)
+		__field(u8,		dlc)
+		__field(int,		len)
+		__field(int,		actual)
+		__field(u64,		pos)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->can_id = can_id;
+		__entry->dlc = dlc;
+		__entry->len = len;
+		__entry->actual = actual;
+		__entry->pos = pos;
+	),
+
+	TP_printk("hlcan%d can_id=0x%08x dlc=%u len=%d actual=%d queued=%d pos=%llu",
+		  __entry->channel, __entry->can_id, __entry->dlc,
+		  __entry->len, __entry->actual,
+		  __entry->len - __entry->actual, __entry->pos)
+);
+
+/* slcan_transmit() wrote actual more bytes, left are still queued */
+TRACE_EVENT(hlcan_tx_drain,
+	TP_PROTO(int channel, int actual, int left, u64 pos),
+	TP_ARGS(channel, actual, left, pos),
+
+	TP_STRUCT__entry(
+		__field(int,	channel)
+		__field(int,	actual)
+		__field(int,	left)
+		__field(u64,	pos)
+	),
+
+	TP_fast_assign(
+		__entry->channel = channel;
+		__entry->actual = actual;
+		__entry->left = left;
+		__entry->pos = pos;
+	),
+
+	TP_printk("hlcan%d actual=%d left=%d pos=%llu",
+		  __entry->channel, __entry->actual, __entry->left,
+		  __entry->pos)
+);
+
+#endif /* _HLCAN_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hlcan_trace
+#include <trace/define_trace.h>